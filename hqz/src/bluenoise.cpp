@@ -0,0 +1,315 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <vector>
+#include "bluenoise.h"
+
+static const unsigned kArea = kBlueNoiseSize * kBlueNoiseSize;
+
+
+/*
+ * The rank of each pixel in the tile, from 0 to kArea - 1, row by row.
+ *
+ * These were made once with Ulichney's void-and-cluster method: a Gaussian
+ * energy filter with sigma 1.5 pixels, wrapping at the edges, starting from
+ * a random pattern with 10% of the pixels set. The ranks are stored rather
+ * than generated at startup because the floating point comparisons in that
+ * method can break ties differently on different compilers and CPUs, and
+ * every machine rendering or merging a frame must dither it identically.
+ */
+
+static const uint16_t kRanks[kArea] = {
+    1146,  608, 2320, 1506, 3876,  326,  777, 3731,   70, 1369, 3808,  379, 3277,  857, 3723, 3004,
+    2299, 1047, 4001, 2868, 1209, 3681, 2615,  720, 1588, 2024, 2746, 3449, 3006,  426, 2449,  855,
+    3917, 2912, 1056, 3740, 1394, 3393,  604, 3554, 1442, 2330,  429, 1099, 2494, 2011, 1294,  310,
+    2946, 3789, 1450,  526, 1970, 2663,  265, 1656, 2157, 2789,  200, 1619, 1076,   63,  914, 1995,
+    2955, 1723, 3478,  907, 2813, 1254, 1736, 2656, 3323,  890, 3029, 2013, 1698, 2801,  550, 1252,
+    3503,   88, 1483, 2469,  340,  930, 1808, 3170, 4092,   96, 1381,  831, 2223, 4005, 2015, 3427,
+    2612, 1593, 2067,  459, 3042, 2255, 1759,  323, 2708,  722, 3958, 3404,  248, 3187, 3721, 1606,
+    1951,  169, 2478, 4030,  867, 3571, 1102, 2543, 3689,  949, 3901, 2427, 3101, 3988, 2279, 3367,
+     291, 3845, 2575,   20, 3179, 2228, 3533,  473, 1566, 2352,  576, 3564,  187, 2263, 4061, 1869,
+    2676,  747, 3648, 3033, 2199, 3858,  168, 2278, 1049, 2898, 2420, 3656,  214, 1621, 1045,  511,
+    1354,   43, 3585, 2759,  738, 1128, 3943, 3285, 2039, 2948, 1281, 1827, 2784,  601,  959, 2637,
+    3593, 1106, 3207, 1682,  104, 2287, 3081,  669, 1472, 3271,  549, 1279, 1944,  728, 2732, 1300,
+     666, 2167, 1365, 1952,  589, 4027,  970, 2065, 2934, 3975, 1142, 2634, 1406, 3373,  998,  304,
+    3252, 2121, 1702,  434, 1287, 3247, 2740, 1426, 3417,  461, 1732, 3157, 1221, 2738, 3755, 3047,
+    2250, 3242,  952, 1667, 3803, 2578,   84, 1560,  963, 3640,  175, 2264, 1531, 4019, 2347,  430,
+    2896,  710, 2168, 2766, 3374, 1382, 3812, 1839,    5, 2029, 2318, 2916, 3423,  258, 1527, 3583,
+    3056, 1032, 3298, 3729, 1617, 2425,  149, 3420, 1315,  256, 1885, 3790,  719, 2995, 1654, 2495,
+    1332, 3893,  965, 3421, 2001,  581, 1680, 3761,  798, 2117, 3921,  694, 1996, 3390,  294, 1866,
+     704, 3952, 2475,  242, 2111, 1328, 3143, 2358,  521, 2547, 3260,  800, 3025, 1189, 2066, 3349,
+    1798, 1266, 3701,  507, 1039, 2069,  402, 2651, 2978, 3646,  896,  396, 1725, 3724, 2374, 1900,
+    4070, 2703,  407,  812, 2648, 1241, 3100, 1778, 2685,  790, 3192, 2397,   78, 2088, 3757,  560,
+    3118,  184, 2783, 2414, 3998, 1087, 2558,  226, 3109, 1349, 2771,   22, 2589,  872, 2382, 1484,
+    2773, 1222, 1913, 3515, 2947,  405, 3685, 1857, 3999, 1396, 1945, 3826,  382, 3536,   24, 1451,
+    3900,  203, 3009, 1563, 2467, 3530,  842, 4076, 1126, 1598, 2501, 3971, 1187, 2792,  939,  162,
+    1260, 1646, 2296, 3587, 2963,  335, 3898,  564, 3669, 2138, 1611, 3467, 1298, 2753,  875, 3492,
+    2254, 1896,  693, 1548,  290, 2957, 3620, 1898, 2442, 1061, 3523, 1641, 3715, 1263, 4058, 3188,
+     372, 3356,  566, 1497,  832, 2627, 1098,  695, 2887,  117, 1108, 2677, 1674, 2462, 2932,  740,
+    2591, 2284, 1927, 3802,  301, 3102, 1737, 2304,  518, 3402,  221, 3155, 2176,  520, 3231, 2471,
+     606, 2913,   90, 1863,  941, 2113, 1500, 2376, 1119, 2902,  392, 1014, 3838, 1855,  355, 1555,
+    1073, 2987, 3816, 3351,  911, 2122, 1387,  676, 4037,  325, 2225, 3238,  568, 2082,  148, 1762,
+    1031, 3817, 2342, 3083, 4033, 2041, 3350, 1584, 3461, 2171, 3612, 3137,  577, 1001, 1954, 3627,
+    1052, 3165,  565,  934, 2739, 1235,  118, 3292, 1364, 2706, 1912,  794, 1469, 3866, 1817, 3451,
+    2087, 3928, 3197, 1419, 3804, 3312,  743, 3499,   30, 4082, 2610,  645, 2972, 2349, 3302, 3994,
+    2601,   18, 1320, 1799, 2654, 3201,   82, 3435, 1655, 3044,  801, 1379, 2856, 2459, 3580, 2968,
+    2598, 2060,  234, 1178, 1755,    2, 2323,  437, 2701,  924,  331, 1461, 2322, 4087, 3282,  409,
+    1668, 3973, 1413, 3409, 2174, 3916, 2564, 2021, 3619,  992, 3794, 2415, 2918,   35, 1330,  836,
+    2669,  457, 1077, 2245,  244, 2573, 1695, 3048, 2018, 1270, 1797, 3355, 1496,  126, 1215, 2103,
+     618, 3594, 2392,  354, 3732,  745, 2317, 2816, 1012, 2586, 1993, 3888,  341, 1063, 1515,  799,
+     475, 1408, 3684, 2841,  630, 3541, 2962, 1232, 3914, 1932, 2550, 3773, 1836,  167, 1366, 2790,
+    2222,   97, 2884, 1847,  393, 1539,  874,  558, 2941,  157, 1643,  466, 3543, 2004, 3104, 3660,
+    1475, 1776, 2527, 3486,  619, 2869, 1055,  417, 2451, 3617,  264, 2216, 3925,  824, 2840, 3198,
+    1605,  947, 3074, 2071, 1156, 1608, 3936, 1923,  504, 3763,  101, 3380, 1826, 3094, 3946, 1961,
+    3518, 3173,  898, 2486, 3867, 1470,  835, 3295, 1632,  654, 3212, 1197,  751, 3049, 2485,  870,
+    3474, 1227, 2492,  756, 3679, 3168, 2775, 1804, 4006, 2203, 3218, 1250, 2646,  989, 2315,  278,
+    2958, 3378,  775, 3885, 1297, 1891, 3995, 3300, 1543,  839, 3127, 1104, 2579, 1728, 3702,  439,
+    1959, 2761, 4075,  543, 3509, 2927,  257, 1231, 3233, 1501, 2366, 1186, 2682,  664, 2275,   60,
+    2733, 1691, 2178,  172, 1852, 2728, 2140,  220, 2389, 3651,   65, 2749, 3507, 2044, 3879,  479,
+    1769, 3727, 3095, 1109, 2280,   31, 3522, 1044, 1409, 2528,  773, 3850, 1765,  593, 4020, 1175,
+    3762,   64, 2149, 1557, 2971,  119, 2128,  685, 2691, 3835, 1876,  545, 3501,  201, 2434, 1058,
+    3441,  230, 1346, 1747, 2258,  876, 2667, 3641, 2090,  838, 3575, 1675,  440, 3320,  999, 3778,
+    1206,  544, 3459, 1280, 3314,  453, 1093, 4056, 2859, 1344, 2214, 1701,  399, 1090, 1581, 3333,
+    2096,  627,  218, 4038, 1939, 1316, 2431,  463, 3354,  260, 1948, 2876,  109, 3399, 2776, 1906,
+    2391, 1026, 2760,  492, 3250, 2405, 3540, 1236,  305, 2283, 2923, 1317, 2765, 2042, 1384, 3846,
+    2219,  770, 2594, 3358,   59, 3206, 1423,  377, 2515, 3093,  202, 2882, 4088, 2075, 2580, 1586,
+    3019, 2458, 4017,  850, 2372, 3692, 3037, 1768,  359,  969, 3131, 3985, 2443, 3008,  112, 2811,
+    1312, 2356, 2689, 1556, 2922,  699, 3824, 2048, 2986, 3675, 1143, 3278, 1438, 2145,  860,  436,
+    1390, 3334, 1814, 3662, 1124,  789, 1689, 3057, 3733, 1485,   79, 4000,  767, 3248,  471, 3070,
+    1565, 2931, 3880, 1036, 2438, 1977, 3987, 1788,  620, 3865, 1140, 1936,  726, 1333,  288, 3493,
+     814,  134, 1938, 2863, 1642,  635, 1412, 2488, 3490, 2017,  481, 1448,  759, 3735, 2244,  944,
+    3929, 3246,  837, 3567,  306, 3301, 2722, 1482,  754, 1690, 2616,  639, 2403, 3912, 1664, 3159,
+     714, 4051,  236, 2537, 2064, 3937,  350, 2583, 1962,  865, 3166, 2177, 1659, 3643,  935, 2466,
+     114, 1905,  498, 1478, 3614,  696, 1107, 2949, 2246, 1486, 2735, 3446, 2373, 3162, 3745, 1805,
+    2212, 3270, 1386,  336, 3221, 2130,   46, 3783,  734, 3240, 2613, 3597, 1909, 1258, 3416,  299,
+    1711,  419, 1928, 1190, 2251, 1748, 1091,  145, 4091, 2217,  406, 3750, 1065,  189, 3535, 2626,
+    2229, 1578, 2908,  597, 1327, 2752, 3372, 1072,  488, 3513, 2552, 1165,  334, 2609, 1853, 4035,
+    1164, 3514, 2190, 3043,  366, 2747, 3429,  143, 3730,  931,  449, 1657,   11,  974, 2786,  462,
+    1238, 3854, 2554, 3591, 1057, 3907, 2785, 1223, 2267, 1585, 1029,   87, 2943,  546, 2632, 2081,
+    2903, 3676, 2567, 3066, 3967,  573, 3607, 2388, 2895, 1243, 3440, 3072, 1979, 2925, 1267,  344,
+    3053, 1067, 3480, 1772, 3788,    1, 1551, 2147, 2960, 1712, 3825,  658, 3408, 2897, 1443,  626,
+    3241, 2709,  817, 3756, 1661, 2137, 1283, 2546, 1740, 3071, 3603, 2497, 3922, 2023, 1488, 2328,
+    2914,  925,  551, 1703, 2407,  783, 1897, 3357,  246, 2893, 3965, 2363, 3375, 1622, 4072, 1048,
+    1362,  688, 1505,   51,  928, 2645, 1991, 3222,  884, 1878,   17, 1530,  736, 2534, 1742, 3743,
+    1958,  102, 2456,  868, 2316, 3080,  816, 4069, 2424,  141, 1400, 2325, 1940,   27, 3709, 2332,
+     240, 1726, 1334, 2476,   98, 4060,  762, 3328,  280, 2155,  735, 1302, 3291,  579, 3120, 4029,
+     207, 3483, 2076, 2999,  154, 3156, 1504,  541, 3672, 1831,  653, 1290, 2012,  873,  152, 3148,
+    3516, 2435, 3863, 2173, 3310, 1306,  222, 1579,  552, 3769, 2731, 2293, 3993,  446, 3329,  791,
+    3910, 1435, 3220, 3695,  460, 1946, 3566, 1289,  582, 3342,  960, 3099, 3974, 1277,  871, 3020,
+    2034, 3942,  451, 3210, 1071, 2980, 1914, 1453, 3905, 1127, 2888, 1867,  179, 2562, 1179,  771,
+    1783, 2659, 1433, 3722, 1200, 4052, 2721, 2208, 1144, 2540, 3228,  386, 2852, 3760, 2533, 2163,
+     333, 1861,  525, 2846, 1706, 3653, 2951, 3931, 2500, 3284, 1311,  982, 3153, 2139, 1181, 2763,
+    2221,  659, 2710, 1213, 1658, 2890,  197, 2666, 1791, 3798, 2788, 1645,  450, 2198, 2686, 1494,
+    3433, 1025, 2797, 1841, 3560, 2308,  519, 2829, 2460,  425, 3678, 2303, 3471, 1613, 3699, 2154,
+    3338, 1079,  428, 2344,  690, 2000,  311, 3428,  822, 3853, 1468, 2248, 3551, 1734,  610, 1322,
+    2933,  954, 3366, 1176,  322,  757, 2230, 1020,  339, 2054,  647, 3644,  183, 1607, 3494,  313,
+    1718, 3550,  176, 2151, 3992,  984, 2260, 3268,  887, 2104,  227, 2539,  760, 3237, 3631,  289,
+     636, 2383, 3696,  729, 1474,  225, 3809,  882, 2022, 3181, 1405,  623,  948, 2996,  394, 2804,
+     124, 3833, 3185, 1767, 3504, 2553, 1380, 3059, 1775,    4, 2787,  933,  282, 1185, 3266, 3968,
+    1620, 3712, 2618, 2084, 4050, 1849, 2673, 1452, 3528, 1708, 3015, 2461, 1919, 2885,  829, 2483,
+    3060, 1007, 1564, 3150,  681, 3439, 1428,  421, 3633, 1374, 3160, 1153, 3752, 1757, 1070, 1983,
+    3123, 1614,   49, 2142, 2690, 3253, 1286, 3436, 1669,   45, 4043, 2679, 1828, 3890, 1295, 1933,
+    2455, 1480,  823, 2814,   72,  961, 3767,  501, 2411, 3487, 2050, 4021, 3096, 1943, 2639,   58,
+    2337,  748,  223, 1473, 2984, 3400,  514, 3151, 2305,   71, 4007, 1420,  534, 3737, 1240, 4074,
+     456, 2779, 3764, 2423,  281, 2641, 1967, 2974, 2336,  672, 4013, 1955, 2862,   91, 2433, 4095,
+    2664, 1141, 3902, 2950,  987, 1750, 2490,  600, 2937, 1103, 2152, 3315,  241, 2365,  725, 3415,
+     553, 3064, 2134, 3920, 1590, 3287, 1924, 2864, 1134, 1615,  561, 1293, 2436,  765, 3526, 1075,
+    2035, 3073, 3547, 2428,  972,  116, 1291, 3810,  723, 1205, 2769,  927, 3376, 2204,   95, 1941,
+    1460,  739, 2043, 1174, 1812, 3616, 1084, 3874,   32, 1678, 2498,  474, 1508, 3470,  700, 1415,
+     378, 3362, 1899,  570, 3611,  364, 3990, 2063, 3713, 2595,  499, 1599, 1210, 3628, 2939, 1554,
+    4080, 1133,  293, 2604, 1214, 2297,  721, 3982,  190, 2623, 3751, 3318,  155, 1503, 2998,  510,
+    3775, 1326, 1823,  533, 3889, 2126, 2806, 1832, 2506, 3632, 2016,  279, 3032, 1559, 2620, 3267,
+    2226, 3484,   53, 3941, 3108,  491, 1623,  784, 2712, 3529, 1034, 3294, 2210,  946, 3013, 3609,
+    2227,  851, 2532, 1441, 3114, 2334, 1191,  161, 1516,  818, 3105, 3795, 2762,  922, 1994,   50,
+    2684, 1864, 3690,  651, 3482,  250, 3169, 1481, 2079, 3054,  804, 1838, 2858, 2123, 3923, 1683,
+    2661,  261, 3262, 1147, 2548, 1550, 3443,  888,  363, 2973, 1634, 2324, 3926,  649,  994, 3703,
+    1253, 2953, 2560, 1519,  886, 2861, 2445, 3316, 1265, 2080, 2910,  173, 3860, 2734, 2002,  160,
+    1639, 2832, 3819,  237, 1813,  779, 2805, 3202, 3559, 2402, 1895,  180, 2236,  515, 3506, 2327,
+     830, 3172, 1422, 2038, 2915, 1638, 2518,  881, 3555,  383, 2306, 1040, 3674,  329, 1167, 2377,
+     863, 2894, 2078, 3666,  707, 3122,  231, 4031, 1477, 3255,  571, 1162, 3475, 1851, 2881,  259,
+     813, 1717,  512, 3360, 2135,  165, 4064, 1829,  302, 3801,  730, 1789, 1397,  523, 1202, 3972,
+    3146,  509, 1246, 2110, 3340, 3881, 1393, 1969,  403, 1054, 3412, 1345, 3950, 1727, 3230, 1264,
+    3780,  465, 2412,  940, 3635,  506, 3793, 1288, 2726, 1679, 4054, 1446, 2585,  674, 3130, 3422,
+     432, 4083, 1492,   14, 2741, 1882, 1199, 2166, 2440, 1019, 3841, 2590,  171, 1388, 2439, 3989,
+    3234, 3647, 2355, 1137, 3746, 1424, 2270,  642, 3183, 1571, 2642, 3403, 2314, 3226, 2551, 1825,
+    1046, 2369, 3625, 2920,  978,  105, 2644,  670, 4036, 1666, 2905,  706, 2611,  976, 2850,  235,
+    1782, 2800, 3369,  113, 2680, 1824, 2232,  139, 3365,  646, 3163,   39, 3466, 1714, 2238, 1299,
+    1854, 2472, 1005, 3359, 2288, 3768,  484, 2872, 3457,   69, 1724, 2899, 2092, 3335,  584, 1985,
+    1421,  317, 2836, 1908,  373, 3050, 1015, 3642, 2470, 1100,  410, 4024,  892,  239, 3766,  677,
+    3448,   25, 1493,  587, 2496, 1713, 3657, 2162, 3024, 2510,   10, 2086, 3563,  365, 1440, 4008,
+    2243, 1068, 1582, 3894, 1262, 3286, 1008, 3944, 1972, 2452, 1207, 1893, 2921,  966, 3954,  120,
+    3700, 3017,  505, 1758, 1359,  877, 3243, 1637,  702, 2007, 3584,  866,  381, 3753, 1097, 2714,
+    2253,  950, 4010,  665, 3496, 1709, 2687,  103, 1904, 3028, 2182, 1338, 2877, 2098, 1553, 3027,
+    2186, 2757, 3871, 1949, 3495, 1154, 3167,  292, 1285,  889, 3749, 1495, 3209, 2409, 1903, 3058,
+     629, 3602, 2094,  367, 2385,  625, 3026, 1561,  844, 2847,  284, 3868, 2367,  447, 2767, 1518,
+     795, 2143, 3473, 2817, 3883,  283, 2361, 1261, 3970, 2514, 1404, 3189, 2310, 1644, 2966,  133,
+    3777, 3175, 1601, 2596, 2295,  828, 3953, 1368, 3447,  778, 3686,   56, 1834, 3595,  991,  309,
+    1259, 1739,  864, 3089,  361, 2292,  717, 1600, 3849, 1956, 3087,  530, 1089, 3704,  806, 2582,
+      75, 3224,  854, 2990, 1753, 3687, 2587,  332, 3638, 3216, 2150, 1418,  715, 3497, 2040, 3225,
+    2622, 1237,  215,  741, 2511, 1980, 3655, 3007,  205, 2812,  502, 1145, 4079,  763, 3437, 1770,
+     555, 2014,   16, 1172, 3136,  247, 2057, 2837,  464, 1686, 2569, 3177,  660, 2395, 3319, 2693,
+    4071, 3249,  210, 2617, 1399, 4004, 2827, 3325, 2396,  233, 2716, 1745, 2215,  320, 1340, 3857,
+    1707, 1203, 2736, 4068, 1319,   15, 2112, 1160, 1741,  540, 1033, 3736, 3016, 1626, 1115,  314,
+    3624, 1873, 4012, 1616, 3184, 1158,  615, 1794,  958, 2127, 3652, 1810, 2593,  351, 1309, 2503,
+    1081, 3621, 2875, 3455, 1462, 3772, 1082, 3289, 2335, 3831, 1024, 1540, 3955, 1282,  441, 1901,
+     727, 2237, 1173, 3759, 2100,  936, 1802,  503, 1118, 3601,  825, 4062, 2521, 3454, 2919, 2049,
+    3361, 2321,  477, 1974,  718, 3235, 2835, 3976, 2513, 3527, 2717, 1862,   94, 2563, 3938,  673,
+    2354, 3082, 1027, 2235, 3598,   57, 2635, 3382, 3830, 1458, 3112,   34, 2906, 2030, 3855, 3092,
+    2329, 1532,  821, 2160,  535, 1846, 2629,  713, 1313,  194, 2983, 2268,  274, 2807, 3726, 1580,
+    2526, 3430,  485, 1719, 3035,  182, 3502, 2681, 2153, 1536, 3138, 1230,  127, 1573,  578,  937,
+     269, 1491, 3782, 2608, 3489, 1525,  903,  422, 1373, 2249,  321, 3290,  897, 2106, 3363, 1376,
+    1731,  125, 2719,  472, 1389, 2964, 1589, 2285,  368,  742, 2357, 1042, 3398, 1510,  849,  216,
+    1818, 4040,  300, 2522, 3661, 2967,  328, 4085, 1990, 3525, 1760,  847, 3339, 1998,  956, 3069,
+     138, 1363, 2750, 3604,  632, 2508, 1314, 3918,   68, 2878,  569, 1918, 3308, 2802, 3964, 2404,
+    3537, 3003, 1018,  198, 1822, 2390, 3797, 2020, 3425,  761, 1652, 4077, 1271, 2930,  418, 2474,
+    3847,  807, 3377, 3781, 1968,  680, 4055, 1069, 2838, 3258, 1721, 3966,  424, 2187, 3636, 2825,
+     621, 2727, 3410, 1296, 1688,  909, 2272, 1569, 3174, 2665,  538, 3785, 2541, 1431,  496, 3556,
+    2073, 3861,  921, 2276, 1513, 3272, 2047,  776, 1716, 3747, 2282, 3553,  793, 2129, 1180, 1793,
+    2711,  634, 2093, 3193, 1188,  547, 3045,  191, 2866, 1132, 3132, 2400,  567, 3682, 1966, 1000,
+    3011, 2136, 1572, 2463,  980, 3321, 2125,  232, 1889, 3738, 1308, 2705,  712, 2529, 1113, 3280,
+    1357, 2036, 1006, 3119,   67, 3821, 3383, 1170,  131,  967, 2124, 1248,    6, 4034, 2261, 2860,
+     753, 1807, 3116,   41, 4049, 1088,  286, 2778, 3330, 1003,  327, 1402, 2657,  433, 3090,   29,
+    1331, 3658, 1610, 4014, 2704, 3588, 1432, 1785, 2568, 3739,  136, 1917, 2751, 1568,   21, 2650,
+    3574,  312, 1224, 3103,  137, 2742, 1361, 3586, 2502,  622,  178, 3088, 1935, 3872, 1648,   83,
+    2468, 3915,  489, 2307, 2662, 1931,  548, 2809, 2368, 3667, 2873, 3200, 1833, 2707, 1078, 1544,
+    3326,  401, 1272, 2602, 1883, 2904, 3534, 2224, 1351, 2499, 3062, 3886, 1722, 3622,  891, 3897,
+    2274,  375, 2473,  810,   77, 2202,  983, 3939,  637, 2132, 1407, 3599,  820, 3219, 3932, 1342,
+     679, 1871, 3961,  603, 1786, 3814,  455, 3010, 1603, 1136, 2211, 3491, 1410,  404, 3002, 3479,
+     786, 2879, 1499, 3683,  826, 3264, 1459, 3948, 1720,  644, 1383,  390, 3418,  683, 3693,  159,
+    2406, 3947, 2115, 3582,  531,  880, 1567,  387, 3997,  667, 2003,  100, 2430, 1251, 3217, 1844,
+    2855, 3391, 1148, 2985, 1843, 3322, 2520,  296, 3223,  916, 2952,  476, 2312, 1112, 1781, 2370,
+    3419, 2828, 2188, 3465, 2566, 1114, 2291,  852, 3397, 2774, 4023,  769, 2559, 1010, 2313, 1837,
+    1193,  164, 3213, 1790,  298, 2207, 1080,  255, 3018, 2019, 3869, 2480, 1009, 2165, 1705, 3040,
+    1163, 2768,  840, 1625, 3171, 3842, 2549, 1930, 2851, 1192, 3386,  929, 2970,  557, 2114,  204,
+    1498,  585, 2045, 3843, 1521,  559, 3552, 1324, 1696, 2419, 4015, 1845, 3411,  212, 3091,  483,
+     957, 1520,  263,  869, 1456, 3288, 1978, 3884,  358, 1911,   73, 1663, 3296, 3673,  271, 3837,
+    2621, 3606, 2257,  995, 4045, 2764, 3531, 2447,  841, 3256,  153, 1595, 2961, 3959,  330, 3517,
+    1937,  508, 3387,  211, 2301, 1139,   86, 3677,  524, 1660, 3786, 2195, 1547, 4084, 2574, 3511,
+    1013, 3716, 2729,  275, 3154, 1110, 2058, 2744, 3774,   48, 1152, 2600, 1449, 3742, 2056, 2675,
+    4026, 3208, 2417, 3734, 2909,   28,  684, 2606, 1430, 3205, 2437, 1247, 2791,  599, 2118, 1574,
+     708, 1947,  468, 3021, 1343,  617, 1884, 1535, 3800, 1220, 2252, 3557,  522, 1305, 2576,  905,
+    2360, 3765, 1355, 2979, 1875, 2781, 1439, 3263, 2346, 3121,  371, 2658,  251, 3254,  796, 1752,
+    3041, 2311, 1352,  781, 2378, 4065,  348, 3052,  711, 2233, 3306,  411,  858, 2854,  650, 1292,
+      89, 1965, 1086,  532, 2089, 3538, 1749, 2997, 1059, 3600,  500, 3828, 1865, 1122, 2969, 3276,
+    1378, 2833, 3877, 1633, 2507, 3191,   40, 2883,  384, 2688, 1811,  878, 2780, 2008, 3341, 1514,
+      47, 1763, 2531,  979, 3983,  686, 3505,  993, 2051,  737, 1367, 3592, 1021, 2006, 1339,  415,
+    3960,  170, 1916, 3384, 1576, 2653,  908, 1777, 1245, 3613, 1597, 3030, 3904, 1746, 2381, 3654,
+    1673, 2892, 3851, 1583, 2715, 1198, 4063,  273, 2234,  752, 2091, 2907,  362, 2393, 4081,    9,
+    3477, 2359,  879,  185, 3569, 1135, 3718, 2053, 3388,  602, 4041, 3152,  108, 3720,  678, 2844,
+    4086, 3107,  605, 3431,  370, 2172, 1636,  229, 3014, 4003, 2755, 1784, 2401, 3820, 2942, 2205,
+    2607,  977, 3608, 2818,   61, 1992, 3698, 3244, 2454,  186, 2027, 1041, 2220,  144, 3203,  990,
+    3381,  703, 2481,  174, 3182,  809, 2364, 1545, 3758, 3134, 1635,  988, 3453, 1526,  853, 1890,
+     442, 1149, 3348, 2159, 1819,  772, 2345, 1377,  932, 2493, 1512, 1120, 2339, 1692, 1218, 2107,
+     444, 1129, 1975, 1466, 2619, 3075, 3791, 2487, 1856, 1074,    7, 3405,  648,  177, 3460,  709,
+    1538, 3086,  575, 1217, 3903,  682, 1416,  315, 2853, 3984,  671, 2674, 3532,  580, 1502, 2581,
+     395, 2161, 1358, 3481, 1795,  478, 3389, 2803, 1268,  135, 2603, 3963,  224, 3145, 2696, 3711,
+    2525, 1733, 3012,  400, 2756, 3934,  438, 3068, 3806, 1894,  360, 3520, 2678,  295, 3839, 3245,
+    2561, 3626, 2289, 3848,   76, 1256,  912,  588, 3565, 1511, 2213, 3078, 1304, 1677, 2724, 1155,
+    3805, 2095, 1787, 2477, 3124, 2259, 3452, 2077,  986, 1517, 3141, 1806, 1269, 2981, 4089, 1942,
+    3719, 3084,  915, 3978, 2119, 2660, 1002, 1963,  611, 3524, 1874, 1177, 2269,  655, 2074, 1275,
+    2886,  662, 4028, 1417, 3413, 1204, 2605, 1672,  130, 2815, 3215, 2031,  834, 3000, 1850,  901,
+    1549,  303,  802, 2796, 1700, 3353, 1981, 2944, 2638,  454, 3744,  885, 2464, 4016, 1960,  398,
+    3281,  140, 3649,  435, 1631, 1062, 2720,  539, 3663, 2309,  389, 3832,  238, 2418,  746, 1171,
+      42, 1715, 2823,  318, 1216, 3664,   74, 3935, 2901, 2413,  766, 3309, 2810, 1618, 3882,  128,
+    1880, 3542,  968, 2319,   93, 2059,  661, 3297, 2180, 1242,  594, 3977, 1425, 3615,  528, 2386,
+    2945, 3407, 1341, 3158,  495, 2343, 4057,  249, 1201, 3232, 1902, 2824,  277, 3194,  953, 2333,
+    2834, 1353, 2631,  910, 3364,  192, 4032, 1301, 1835, 3275,  859, 2793, 2131, 1630, 3259, 2723,
+    2241, 3434,  652, 2545, 1604, 2992, 2266, 1336, 1671,  342, 3840, 1398,  391, 3485, 1016, 3227,
+    1350,  338, 2636, 1650, 3195, 3694, 1490, 3856,  862, 3544, 1761, 2479,   13, 2156, 1169, 3887,
+     150, 1887, 3986, 2099, 1125, 3576,  780, 1537, 2239, 3913,  724, 1391, 2116,  607, 3562, 1592,
+    3951,  616, 2191, 3859, 2867, 1950, 2422, 2989,   12, 2571, 1465, 3432, 1096, 3645,  480, 3924,
+    1436,  971, 3834, 1982, 3347,  493,  846, 3468, 3147, 1094, 2183, 2982, 1988, 2516,  562, 2300,
+    3001, 2101, 3829,  744, 2821, 1028,  380, 2725, 2348,  245, 2870, 1011, 3424, 2730, 3273, 1628,
+    2655, 1004,  598, 2524,  121, 2772, 1830, 3111, 2570,   81, 1699, 3370, 3771, 2542, 1239,   37,
+    1920, 3022, 1151, 1751,  554, 1401,  808, 3414, 1131, 3908,  572, 1953,  129, 3039,  893, 1929,
+     343, 2926, 2341,  268, 1066, 4039, 2640, 2061,  196, 2536, 3668,  918,   44, 4025, 1662, 3634,
+     206, 1138, 3261,  448, 1915, 2273, 3098, 1796, 1325, 3930, 3144, 1552,  698, 1926,  353,  792,
+    2184, 3456, 2917, 1676, 3327, 1371, 3862,  412, 1050, 3605, 2935, 1117,  219, 1743, 3113, 2718,
+     883, 3444,  349, 3133, 3596, 2271, 3784,  443, 1693, 2218, 2936, 3717, 2505, 1360, 2265, 2649,
+    3239, 1670, 3623, 1347, 3110, 1858, 1463,  687, 3895, 1771,  595, 1577, 3115, 1229, 2670,  768,
+    3899, 2446, 1528, 3521, 1255, 4073,   54, 3462,  668, 1984,  486, 2262, 3577, 4002, 1273, 3161,
+    3705, 1444,  374, 3818,  904, 2201,  691, 3464, 1881, 2158,  497, 2647, 2281, 4042,  733, 2070,
+    3725, 2351, 1454, 2555,   85, 1064, 2758, 2009, 3125,  732, 1278,  319, 1681, 3891,  663, 3472,
+    1184,  123,  782, 2782, 2192,    8, 3630, 2929, 1211, 3251, 2683, 3545, 2286,  431, 3332, 2033,
+    2795, 1792,  122, 2954, 2577,  819, 1612, 2512, 1121, 3659, 2628, 1196,  146, 2441, 2794, 1859,
+      92, 2408, 1157, 1987, 3034,  324, 2432, 2748, 1414, 3940,  785, 3265, 1507,  385, 3337, 1318,
+     243, 1687,  692, 4093, 1879, 3317, 1445,  217, 3979, 2350, 3385, 2743,  981, 3139, 1848,  445,
+    4059, 2453, 1779, 3811,  574, 3305,  942, 2340,  408, 2148,  147, 1085, 1868, 3787, 1471, 1037,
+     583, 3610,  902, 1997,  494, 3579, 3180, 2105, 2900,  209, 3311, 1816, 3079, 1509,  923,  592,
+    2889, 4048,  749, 2643, 3688, 1774, 3352,  917,  181, 2880, 1208, 3680, 2025,  975, 2798, 3870,
+    2504, 2976, 3488,  943, 2857,  537, 2429, 3510, 1035, 1558,  420, 1971, 3546,   36, 2831, 1437,
+    2120, 2956, 3345, 1043, 2535, 1529, 2745, 1756, 3706, 1372, 4011, 2849,  764, 2509,  285, 3178,
+    2338, 1303, 3117, 3945, 2290, 1392,  276,  955, 3991, 1542,  815, 3852,  527, 2179, 3776, 3257,
+    1629, 2108, 3445, 1524,   23, 1233, 3981, 1587, 3149, 2247, 1764,   62, 3063, 2410, 1801,  590,
+    1092, 1973,  163, 2164, 1257, 3822, 1754,  803, 2977, 2614, 3741,  675, 2209, 1159, 2421, 3670,
+     913,  513, 1370,  158, 2037, 3980,  287, 3406,  609, 3051, 1684,  482, 3508, 2959, 1624, 4044,
+    2055, 2713,  345, 1653, 1030, 2826, 3770, 1780,  536, 2444, 2032, 2822, 1116, 3476,  252, 2523,
+     996,  308, 3129,  563, 2375, 2871,  628, 2028,  376, 3561, 2556,  631, 3969, 1356,  267, 3438,
+    3135, 1487, 3710, 3229, 2572,  297, 3085, 2196,   66, 1877, 1335, 2928, 3962, 1596, 3379,  254,
+    1910, 3864, 2362, 3512, 2839, 1183,  805, 1999, 2584,  964, 2426, 2005, 1194, 2197,  920,   19,
+    3395,  750, 3799, 2517, 3426,  633, 2170, 2599, 3450, 1228, 3199,   80, 1710, 2697, 1395, 1986,
+    3927, 1284, 2695, 1820, 3590,  973, 3274, 2652, 3779,  997, 1447, 3396,  919, 2848, 3748, 2097,
+     856, 2702,  487, 1730,  755, 1467, 3572, 1182, 4018, 3211,  369,  945, 2557,  458,  833, 3036,
+    2671, 1647, 3190,  705, 1591, 3665, 2994, 1455, 3815,   55, 3324, 3919,  356, 3142, 3671, 1735,
+    2911, 1195, 1523,  228, 1870, 3038,   33, 1457, 2988,  337, 3728, 2242, 4090,  845, 3371,  643,
+    3568, 2294,  811, 3827, 1385, 2169,  156, 1310, 1744,  517, 3005, 1888, 2256,  467, 1541, 2457,
+       0, 3996, 1166, 2371, 3878, 2737, 1976,  638, 2482, 1534, 3589, 2068, 3313, 1821, 3792, 2231,
+    1219,  347, 1023, 2144,  388, 2448,  213, 2206, 3176, 1244, 1602,  731, 2754, 1411, 2465,  542,
+    1957, 3578, 2240, 3164,  827, 3629, 1083, 3911,  716, 1921,  951, 1429,  427, 2416, 3023,  199,
+    1562, 2874,  110, 3299,  452, 2965, 4046, 2450, 3442, 2200, 3896,  111, 2694, 3293, 1130, 3548,
+    1840, 2938, 2085, 3463,  106, 1017, 3283,  270, 2845,  774, 2387,  188, 1168, 2700, 1427,  142,
+    3279, 4009, 2770, 3573, 3061, 1815, 4094,  926,  556, 2808, 2146, 3539, 1872,  193, 3875, 1060,
+     107, 2625,  469, 4067, 1329, 2052, 2699, 1704, 2326, 3570, 2630, 3097, 3618, 1809, 1038, 2189,
+    3186, 1892, 1105, 2544, 2010, 1627,  657, 1123,  253, 2842,  787, 1225, 1649, 4053,  697, 3077,
+     397,  906, 1476,  586, 2975, 1800, 2302, 3906, 1226, 3714, 1766, 2993, 4078,  613, 3498, 2026,
+    2484,  788, 1886, 1337,  596, 1095, 2633, 3458, 1729, 3707,  266, 2530,  900, 3307, 2181, 3031,
+    3754,  848, 1694, 2865, 2384,  166, 3346,  414, 2940, 1274,  195, 2083,  701, 2830, 1307, 3892,
+     529, 3650, 1434, 3909,  861, 3549, 2672, 3204, 1934, 1533, 3558, 3128, 2072,  262, 2277, 1575,
+    2624, 3823, 3336, 2565, 1249, 3581,  470, 1570, 2133, 3304,  516, 1375, 2194, 1022, 3067,  413,
+    1546, 3637,   26, 2394, 3813, 3236, 1522,   99, 2399, 1051, 3046, 1489, 4047, 1234,  614, 1594,
+    1323, 2109, 3392, 1101,  641, 3691, 1464,  985, 4022,  612, 3394, 1640, 3957,    3, 3401, 2491,
+     895, 2692,  272, 3076, 2331,   38, 1348, 3873,  894, 2353,  307, 2538, 3796,  962, 2820, 3639,
+    1212, 2193,  316, 1685, 4066,  843, 2799, 3126,  115,  899, 2592, 3519,   52, 2819, 1738, 3933,
+    1150, 2668, 3140, 1665,  346, 2185,  797, 2924, 1925, 3844,  689, 2062,  423, 2843, 2380, 3214,
+    2698, 3956,  208, 3065, 1907, 2519, 3106, 2175, 1842, 2777, 2298, 1053, 2588, 1479, 2046,  352,
+    1651, 3331, 1989,  624, 1697, 3344, 2102,  416, 2991, 3708, 1161,  591, 1803, 1403, 3269,  132,
+    1860,  656, 3196, 2398,  151, 1964, 2489, 1111, 3836, 1922, 3055, 1609, 3807,  758, 2379, 3343,
+     640, 2141,  938, 3469, 2891, 1276, 3949, 3368,  490, 1321, 3303, 2597, 3500, 1773, 3697,  357,
+};
+
+const float *blueNoiseTile()
+{
+    // Dither values are the centers of kArea equal steps. All are exact in a float.
+    static const std::vector<float> tile = [] {
+        std::vector<float> t(kArea);
+        for (unsigned p = 0; p < kArea; ++p)
+            t[p] = (kRanks[p] + 0.5f) / kArea;
+        return t;
+    }();
+    return &tile[0];
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+
+/*
+ * A square tile of blue noise, for dithering: values in [0, 1) whose
+ * spatial spectrum has little low-frequency energy, so the grain it leaves
+ * is finer and less visible than white noise. The tile wraps seamlessly.
+ * Values are stored row by row, and are the same on every machine.
+ */
+
+static const unsigned kBlueNoiseBits = 6;
+static const unsigned kBlueNoiseSize = 1 << kBlueNoiseBits;
+
+const float *blueNoiseTile();
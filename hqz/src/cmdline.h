@@ -0,0 +1,41 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+
+
+/*
+ * Strict parsing for command line numbers, shared by hqz and hqz-merge.
+ */
+
+// A whole number from 'min' to 'max'. Rejects signs, trailing junk and overflow.
+bool parseWhole(const char *arg, uint64_t min, uint64_t max, uint64_t &value);
+bool parseWhole(const char *arg, uint32_t min, uint32_t max, uint32_t &value);
+
+// A whole number, at least one.
+bool parseCount(const char *arg, unsigned &value);
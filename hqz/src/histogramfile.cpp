@@ -0,0 +1,279 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "histogramfile.h"
+
+static const char kMagic[8] = "HQZHIST";
+
+static_assert(sizeof(HistogramHeader) <= HistogramHeader::kHeaderSize, "Header too large");
+
+
+HistogramHeader::HistogramHeader()
+{
+    memset(this, 0, sizeof *this);
+    memcpy(magic, kMagic, sizeof magic);
+    version = kVersion;
+    headerSize = kHeaderSize;
+    channels = 3;
+}
+
+bool saveHistogram(const char *path, const HistogramHeader &header, const HistogramImage &image)
+{
+    std::string temp = std::string(path) + ".tmp";
+    FILE *f = fopen(temp.c_str(), "wb");
+    if (!f)
+        return false;
+
+    char page[HistogramHeader::kHeaderSize];
+    memset(page, 0, sizeof page);
+    memcpy(page, &header, sizeof header);
+    bool ok = fwrite(page, sizeof page, 1, f) == 1;
+
+    // Stream the counters a few rows at a time
+    unsigned width = image.width(), height = image.height();
+    unsigned rows = std::max<size_t>(1, (4 << 20) / (sizeof(int64_t) * image.channels() * std::max(1u, width)));
+    std::vector<int64_t> buffer(size_t(rows) * width * image.channels());
+
+    for (unsigned top = 0; ok && top < height; top += rows) {
+        unsigned bottom = std::min(height, top + rows);
+        size_t n = size_t(bottom - top) * width * image.channels();
+        image.readRows(&buffer[0], top, bottom);
+        ok = fwrite(&buffer[0], sizeof buffer[0], n, f) == n;
+    }
+
+    ok = fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(temp.c_str(), path) == 0;
+
+    if (!ok) {
+        int e = errno;
+        unlink(temp.c_str());
+        errno = e;
+    }
+    return ok;
+}
+
+bool HistogramFile::open(const char *path)
+{
+    close();
+    mPath = path;
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        mError = std::string(path) + ": " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < off_t(sizeof(HistogramHeader))) {
+        mError = std::string(path) + ": not a histogram file";
+        ::close(fd);
+        return false;
+    }
+
+    mSize = st.st_size;
+    mMap = mmap(0, mSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mMap == MAP_FAILED) {
+        mMap = 0;
+        mError = std::string(path) + ": " + strerror(errno);
+        return false;
+    }
+
+    const HistogramHeader &h = header();
+    if (memcmp(h.magic, kMagic, sizeof h.magic)) {
+        mError = std::string(path) + ": not a histogram file";
+    } else if (h.version != HistogramHeader::kVersion) {
+        mError = std::string(path) + ": unsupported histogram version " + std::to_string(h.version);
+    } else if ((h.channels != 1 && h.channels != 3) || h.headerSize != HistogramHeader::kHeaderSize
+        || mSize != h.headerSize + h.countsBytes()) {
+        mError = std::string(path) + ": histogram file is damaged or truncated";
+    } else {
+        return true;
+    }
+
+    close();
+    return false;
+}
+
+void HistogramFile::close()
+{
+    if (mMap)
+        munmap(mMap, mSize);
+    mMap = 0;
+    mSize = 0;
+}
+
+bool HistogramFile::addTo(HistogramImage &image) const
+{
+    const HistogramHeader &h = header();
+
+    if (!image.width() && !image.height())
+        image.resize(h.width, h.height, h.channels == 1);
+
+    if (image.width() != h.width || image.height() != h.height || image.channels() != h.channels)
+        return false;
+
+    image.addRows(counts(), 0, h.height);
+    return true;
+}
+
+bool mergeHistograms(const std::vector<const HistogramFile*> &files, HistogramImage &image,
+    HistogramHeader &merged, unsigned threads, bool needRange, std::string &error)
+{
+    if (files.empty()) {
+        error = "No histogram files to merge";
+        return false;
+    }
+
+    const HistogramHeader &first = files[0]->header();
+    merged = first;
+    merged.rays = 0;
+    merged.seconds = 0;
+    merged.checkpoint = 0;
+
+    /*
+     * Every file must come from the same scene JSON. Bounded seed ranges must
+     * not overlap, or the same rays would be counted twice. Unbounded ranges
+     * (renders limited only by time) can't be checked.
+     */
+
+    std::vector<std::pair<uint64_t, size_t> > ranges;
+    uint64_t spanBegin = UINT64_MAX, spanEnd = 0;
+    bool bounded = true;
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        const HistogramHeader &h = files[i]->header();
+
+        if (h.sceneHash != first.sceneHash) {
+            error = std::string(files[i]->path()) + ": rendered from a different scene than " + files[0]->path();
+            return false;
+        }
+        if (h.width != first.width || h.height != first.height || h.channels != first.channels) {
+            error = std::string(files[i]->path()) + ": image size or channels differ from " + files[0]->path();
+            return false;
+        }
+
+        merged.rays += h.rays;
+        merged.seconds += h.seconds;
+        spanBegin = std::min<uint64_t>(spanBegin, h.seedStart);
+        spanEnd = std::max<uint64_t>(spanEnd, uint64_t(h.seedStart) + h.seedCount);
+
+        if (h.seedCount)
+            ranges.push_back(std::make_pair(uint64_t(h.seedStart), i));
+        else
+            bounded = false;
+    }
+
+    /*
+     * The merged header can only claim one range of seeds. If the files leave
+     * gaps (a shard is missing), the span between them would claim seeds that
+     * were never traced, and a later merge with the missing shard would look
+     * like an overlap. So the span is only recorded when the ranges meet.
+     */
+
+    const HistogramFile *gapBefore = 0, *gapAfter = 0;
+
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        const HistogramFile *a = files[ranges[i - 1].second];
+        const HistogramFile *b = files[ranges[i].second];
+        uint64_t end = ranges[i - 1].first + a->header().seedCount;
+        if (ranges[i].first < end) {
+            error = std::string(a->path()) + " and " + b->path() + " have overlapping seed ranges";
+            return false;
+        }
+        if (ranges[i].first > end && !gapBefore) {
+            gapBefore = a;
+            gapAfter = b;
+        }
+    }
+
+    if (gapBefore && needRange) {
+        error = std::string("seeds between ") + gapBefore->path() + " and " + gapAfter->path()
+            + " are missing, so the merged seeds aren't one range";
+        return false;
+    }
+
+    merged.seedStart = spanBegin;
+    merged.seedCount = bounded && !gapBefore ? spanEnd - spanBegin : 0;
+
+    /*
+     * A single file, like a frame being re-exposed, has nothing to sum. If
+     * this build keeps counters in the file's layout, the image just wraps
+     * the mapped counters: no copy, and no memory beyond the page cache.
+     */
+
+    if (files.size() == 1 && image.wrap(files[0]->counts(), first.width, first.height, first.channels == 1))
+        return true;
+
+    /*
+     * Threads take bands of rows, and add that band from every file in turn.
+     * Bands are a multiple of any tile height, so no two threads share a tile.
+     * Each file is read once, front to back, in parallel streams.
+     */
+
+    static const unsigned kBandRows = 64;
+
+    image.resize(first.width, first.height, first.channels == 1);
+    unsigned height = first.height;
+    unsigned bands = (height + kBandRows - 1) / kBandRows;
+    std::atomic<unsigned> next(0);
+
+    auto worker = [&]() {
+        for (unsigned band; (band = next.fetch_add(1)) < bands;) {
+            unsigned top = band * kBandRows;
+            unsigned bottom = std::min(height, top + kBandRows);
+            size_t offset = size_t(top) * first.width * first.channels;
+
+            for (size_t i = 0; i < files.size(); ++i)
+                image.addRows(files[i]->counts() + offset, top, bottom);
+        }
+    };
+
+    threads = std::max(1u, std::min(threads, bands));
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i)
+        workers.push_back(std::thread(worker));
+    worker();
+    for (unsigned i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    return true;
+}
@@ -0,0 +1,125 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "histogramimage.h"
+
+
+/*
+ * Raw histogram files (.hqzh) keep a render's counters, so it can be
+ * tone mapped again or summed with other renders of the same scene.
+ *
+ * The file is a header padded to kHeaderSize bytes, then the counters as
+ * native (little-endian) int64s: row-major, 'channels' per pixel. The
+ * counters are page aligned, so a mapped file can be used as an array.
+ */
+
+struct HistogramHeader {
+    static const uint32_t kVersion = 1;
+    static const uint32_t kHeaderSize = 4096;
+
+    char magic[8];          // "HQZHIST\0"
+    uint32_t version;
+    uint32_t headerSize;    // Offset of the counters, in bytes
+    uint32_t width, height;
+    uint32_t channels;      // 3, or 1 if every light was white
+    uint32_t seedStart;     // First seed of the range this render was given
+    uint64_t seedCount;     // Length of that range, or zero if unbounded
+    uint64_t rays;          // Rays actually traced into these counters
+    uint64_t sceneHash;     // ZScene::hash
+    double lightPower;
+    double exposure;        // From the scene, for tone mapping later
+    double gamma;
+    uint32_t checkpoint;    // Nonzero if 'rays' are exactly the seeds [seedStart, seedStart + rays)
+    double seconds;         // Time spent tracing
+
+    HistogramHeader();
+
+    uint64_t countsBytes() const { return uint64_t(width) * height * channels * sizeof(int64_t); }
+};
+
+
+/*
+ * Write a histogram file, atomically: it's written under a temporary name
+ * and renamed into place once complete, so a crash never leaves a partial
+ * file at 'path'. Returns false with errno set on failure.
+ */
+
+bool saveHistogram(const char *path, const HistogramHeader &header, const HistogramImage &image);
+
+
+/*
+ * A histogram file, mapped read-only.
+ */
+
+class HistogramFile {
+public:
+    HistogramFile() : mMap(0), mSize(0) {}
+    ~HistogramFile() { close(); }
+
+    bool open(const char *path);
+    void close();
+
+    const char *path() const { return mPath.c_str(); }
+    const char *errorText() const { return mError.c_str(); }
+    const HistogramHeader &header() const { return *(const HistogramHeader*) mMap; }
+    const int64_t *counts() const { return (const int64_t*) ((const char*) mMap + header().headerSize); }
+
+    // Add this file's counters to an image, resizing it first if it's empty.
+    // For an image that will be plotted into, like a resumed render.
+    // Returns false if the image has a different size or channel count.
+    bool addTo(HistogramImage &image) const;
+
+    HistogramFile(const HistogramFile &) = delete;
+
+private:
+    void *mMap;
+    size_t mSize;
+    std::string mPath;
+    std::string mError;
+};
+
+
+/*
+ * Sum histogram files into an empty image, on up to 'threads' threads.
+ * The files must be renders of the same scene, at the same size, with
+ * seed ranges that don't overlap. 'merged' gets a header describing the
+ * sum: the total ray count, and the span of seeds the files cover. It's
+ * what ZRender would have produced tracing all those rays in one run.
+ *
+ * If the seed ranges leave gaps, the sum covers no single range and
+ * 'merged.seedCount' is zero; with 'needRange', that's an error instead.
+ * A single file may be wrapped rather than copied, so keep the files open
+ * for as long as the image is in use.
+ * Returns false with a message in 'error' if the files don't belong together.
+ */
+
+bool mergeHistograms(const std::vector<const HistogramFile*> &files, HistogramImage &image,
+    HistogramHeader &merged, unsigned threads, bool needRange, std::string &error);
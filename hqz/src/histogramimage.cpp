@@ -26,43 +26,725 @@
  */
 
 #include <string.h>
+#include <functional>
+#include <thread>
 #include "histogramimage.h"
-#include "prng.h"
+#include "bluenoise.h"
 
+/*
+ * Build with -DHQZ_SIMD_RASTERIZER to use AVX2 (and AVX-512, if available)
+ * for the inner loop of line(). It's off by default: the loop is bound by
+ * the histogram's memory traffic, and on the machines we've measured it
+ * is no faster than the scalar code. Results are identical either way.
+ */
+
+#if defined(HQZ_SIMD_RASTERIZER) && !defined(__AVX2__)
+#undef HQZ_SIMD_RASTERIZER
+#endif
+
+/*
+ * Build with -DHQZ_FIXED_DDA=<bits> for an all-integer inner loop, stepping
+ * along the minor axis in fixed point with that many fraction bits (8 to
+ * 32; 32 gives a 32.32 format). Each coverage weight may differ from the
+ * floating point loop by one count, from rounding, and those differences
+ * add up in pixels that many rays cross. This replaces the SIMD loop
+ * above, which is floating point.
+ */
 
-void HistogramImage::resize(unsigned w, unsigned h)
+#ifdef HQZ_TILED_HISTOGRAM
+#undef HQZ_SIMD_RASTERIZER
+#endif
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+#undef HQZ_SIMD_RASTERIZER
+#endif
+
+#ifdef HQZ_FIXED_DDA
+static_assert(HQZ_FIXED_DDA >= 8 && HQZ_FIXED_DDA <= 32,
+    "HQZ_FIXED_DDA is the number of fraction bits, from 8 to 32");
+#undef HQZ_SIMD_RASTERIZER
+#endif
+
+#ifdef HQZ_SIMD_RASTERIZER
+#include <immintrin.h>
+#endif
+
+
+void HistogramImage::resize(unsigned w, unsigned h, bool mono)
 {
     mWidth = w;
     mHeight = h;
-    mCounts.resize(w * h * kChannels);
+    mChannels = mono ? 1 : kColorCounters;
+    mExternal = 0;
+#ifdef HQZ_TILED_HISTOGRAM
+    mTilesX = padded(w) >> kTileBits;
+#endif
+#ifdef HQZ_SPARSE_HISTOGRAM
+    mTiles.reset(size_t(mTilesX) * (padded(h) >> kTileBits));
+#else
+    mCounts.resize(size_t(padded(w)) * padded(h) * mChannels);
+#endif
+#ifdef HQZ_COMPACT_HISTOGRAM
+    mSpilled.resize((mCounts.size() + 63) / 64);
+    if (!mSpill)
+        mSpill.reset(new SpillStripe[kSpillStripes]);
+#endif
     clear();
 }
 
+bool HistogramImage::wrap(const int64_t *counts, unsigned w, unsigned h, bool mono)
+{
+    // Only the plain layout matches: 64-bit counters, untiled, three per color pixel
+
+#if defined(HQZ_TILED_HISTOGRAM) || defined(HQZ_COMPACT_HISTOGRAM) || defined(HQZ_RGBX_HISTOGRAM)
+    return false;
+#else
+    mWidth = w;
+    mHeight = h;
+    mChannels = mono ? 1 : kColorCounters;
+    mCounts.clear();
+    mCounts.shrink_to_fit();
+    mExternal = counts;
+    return true;
+#endif
+}
+
 void HistogramImage::clear()
 {
+#ifdef HQZ_SPARSE_HISTOGRAM
+    mTiles.reset(mTiles.tiles.size());
+#else
     memset(&mCounts[0], 0, mCounts.size() * sizeof mCounts[0]);
+#endif
+#ifdef HQZ_COMPACT_HISTOGRAM
+    std::fill(mSpilled.begin(), mSpilled.end(), 0);
+    for (unsigned i = 0; i < kSpillStripes; ++i)
+        mSpill[i].high.clear();
+#endif
+}
+
+#ifdef HQZ_SPARSE_HISTOGRAM
+
+HistogramImage::Counter *HistogramImage::allocTile(size_t t)
+{
+    /*
+     * Even without atomic mode, pipelined rasterizers may share a tile that
+     * straddles their bands, so two threads can race to allocate it. The
+     * first one to publish its tile wins, and the other frees its own.
+     */
+
+    size_t bytes = tileCounters() * sizeof(Counter);
+    Counter *p = (Counter*) aligned_alloc(64, bytes);
+    memset(p, 0, bytes);
+    Counter *expected = 0;
+    if (!__atomic_compare_exchange_n(&mTiles.tiles[t], &expected, p,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(p);
+        p = expected;
+    }
+    return p;
+}
+
+#endif  // HQZ_SPARSE_HISTOGRAM
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+
+void HistogramImage::spill(size_t counter, int64_t amount)
+{
+    // Safe to call concurrently, even for counters in the same stripe.
+    SpillStripe &stripe = spillStripe(counter);
+    std::lock_guard<std::mutex> guard(stripe.lock);
+    stripe.high[counter] += amount;
+    __atomic_fetch_or(&mSpilled[counter >> 6], uint64_t(1) << (counter & 63), __ATOMIC_RELAXED);
 }
 
-void HistogramImage::render(std::vector<unsigned char> &rgb, double scale, double exponent)
+void HistogramImage::addSpills(int64_t *values, size_t counter, size_t n) const
+{
+    // Add spilled high parts to values[] for counters [counter, counter + n).
+    // Only call this while nobody is plotting.
+
+    for (size_t i = 0; i < n;) {
+        size_t c = counter + i;
+        uint64_t bits = mSpilled[c >> 6] >> (c & 63);
+
+        if (!bits) {
+            // Skip to the next word
+            i += 64 - (c & 63);
+            continue;
+        }
+        if (bits & 1) {
+            SpillStripe &stripe = spillStripe(c);
+            values[i] += stripe.high.find(c)->second;
+        }
+        i++;
+    }
+}
+
+template <bool kAtomic> inline void HistogramImage::accumulate(Counter *ptr, int32_t value)
+{
+    // On overflow the counter wraps, and we spill the 2^32 it lost (or gained).
+
+    bool overflow;
+    if (kAtomic) {
+        int32_t sum, old = __atomic_fetch_add(ptr, value, __ATOMIC_RELAXED);
+        overflow = __builtin_add_overflow(old, value, &sum);
+    } else {
+        overflow = __builtin_add_overflow(*ptr, value, ptr);
+    }
+
+    if (__builtin_expect(overflow, 0))
+        spill(ptr - &mCounts[0], value > 0 ? (int64_t(1) << 32) : -(int64_t(1) << 32));
+}
+
+#endif  // HQZ_COMPACT_HISTOGRAM
+
+static inline uint32_t __attribute__((always_inline)) hash32(uint32_t i)
+{
+    // The 'lowbias32' integer hash finalizer. Note that hash32(0) == 0.
+
+    i ^= i >> 16;
+    i *= 0x7feb352d;
+    i ^= i >> 15;
+    i *= 0x846ca68b;
+    i ^= i >> 16;
+    return i;
+}
+
+/*
+ * Dither values in [0, 1) for each sample of one frame. Sample 'i' is
+ * channel (i % 3) of pixel (i / 3), in row-major order, so this is a
+ * stateless function of (x, y, channel, frame). Any range of samples can
+ * be tone mapped independently, in any order, with identical results.
+ *
+ * White noise hashes the sample index, mixed with a key for the frame.
+ * Frame zero's key is zero. Blue noise looks up a tile that repeats
+ * across the image, shifted by a different random offset for each
+ * channel and frame.
+ */
+
+class DitherPattern {
+public:
+    DitherPattern(const HistogramImage::Dither &options, unsigned width)
+        : mKey(hash32(options.frame)), mWidth(width),
+          mTile(options.blueNoise ? blueNoiseTile() : 0)
+    {
+        for (unsigned ch = 0; ch < 3; ++ch) {
+            uint32_t shift = hash32(options.frame * 3 + ch + 1);
+            mShiftX[ch] = shift;
+            mShiftY[ch] = shift >> kBlueNoiseBits;
+        }
+    }
+
+    bool blueNoise() const { return mTile != 0; }
+
+    double __attribute__((always_inline)) white(size_t i) const
+    {
+        return hash32(uint32_t(i) ^ mKey) * 2.3283064365386963e-10;
+    }
+
+    double blue(size_t i) const
+    {
+        const unsigned mask = kBlueNoiseSize - 1;
+        size_t pixel = i / 3;
+        unsigned ch = i - pixel * 3;
+        unsigned x = (pixel % mWidth + mShiftX[ch]) & mask;
+        unsigned y = (pixel / mWidth + mShiftY[ch]) & mask;
+        return mTile[y * kBlueNoiseSize + x];
+    }
+
+private:
+    uint32_t mKey;
+    unsigned mWidth;
+    const float *mTile;
+    unsigned mShiftX[3], mShiftY[3];
+};
+
+/*
+ * Output levels for one frame, before dithering: 255 * pow(count * scale,
+ * exponent). Rather than calling pow() per sample, we tabulate the curve
+ * once per frame and interpolate linearly. The table is indexed by the
+ * exponent and top mantissa bits of the scaled count, so its points are
+ * spaced evenly in each octave, where the curve is smooth. It covers
+ * everything from where the curve is under 1/1000 of a level, which we
+ * round down to black, up to where it saturates. The error is around
+ * 1/10000 of a level for common gamma values, so outputs very rarely
+ * differ from pow() by one, when a level plus dither lands that close to
+ * an integer.
+ */
+
+class ToneCurve {
+public:
+    ToneCurve(double scale, double exponent);
+
+    bool linear() const { return mExponent == 1.0; }
+    double scale() const { return mScale; }
+
+    double __attribute__((always_inline)) level(int64_t count) const
+    {
+        double u = std::min(std::max(count * mScale, mLow), mHigh);
+        uint64_t bits;
+        memcpy(&bits, &u, sizeof bits);
+
+        uint64_t offset = bits - mLowBits;
+        size_t j = offset >> kFractionBits;
+        double t = int64_t(offset & ((uint64_t(1) << kFractionBits) - 1)) * kFractionScale;
+        return mTable[j] + (mTable[j + 1] - mTable[j]) * t;
+    }
+
+private:
+    static const int kStepBits = 8;                     // Log2 of table steps per octave
+    static const int kFractionBits = 52 - kStepBits;    // Mantissa bits left for interpolation
+    static constexpr double kFractionScale = 1.0 / (uint64_t(1) << kFractionBits);
+
+    double mScale, mExponent;
+    double mLow, mHigh;
+    uint64_t mLowBits;
+    std::vector<float> mTable;
+};
+
+ToneCurve::ToneCurve(double scale, double exponent)
+    : mScale(scale), mExponent(exponent)
+{
+    if (linear())
+        return;
+
+    int low = std::max(-1000.0, floor(log2(1.0 / (255.0 * 1024.0)) / exponent));
+    int high = std::max(1.0, ceil(log2(255.9 / 255.0) / exponent));
+    mLow = ldexp(1.0, low);
+    mHigh = ldexp(1.0, high);
+    memcpy(&mLowBits, &mLow, sizeof mLowBits);
+
+    // One extra step, so the last interval has an end at mHigh.
+    mTable.resize(((high - low) << kStepBits) + 2);
+    for (size_t j = 0; j < mTable.size(); ++j) {
+        double u = ldexp(1.0 + (j & ((1 << kStepBits) - 1)) / double(1 << kStepBits),
+            low + int(j >> kStepBits));
+        mTable[j] = 255.0 * pow(u, exponent);
+    }
+    mTable[0] = 0;
+}
+
+template <typename Fn> static inline void __attribute__((always_inline)) toneMap(
+    unsigned char *out, const int64_t *counts, size_t i, size_t n, const ToneCurve &curve, Fn dither)
+{
+    if (curve.linear()) {
+        double s = 255.0 * curve.scale();
+        for (size_t k = 0; k != n; ++k) {
+            double v = std::max(0.0, counts[k] * s) + dither(i + k);
+            out[k] = std::min(255.9, v);
+        }
+    } else {
+        for (size_t k = 0; k != n; ++k) {
+            double v = curve.level(counts[k]) + dither(i + k);
+            out[k] = std::max(0.0, std::min(255.9, v));
+        }
+    }
+}
+
+static void toneMap(unsigned char *out, const int64_t *counts, size_t i, size_t n,
+    const ToneCurve &curve, const DitherPattern &dither)
+{
+    // Tone map n samples, the first of which is sample 'i' of the image.
+
+    if (dither.blueNoise())
+        toneMap(out, counts, i, n, curve, [&](size_t j) { return dither.blue(j); });
+    else
+        toneMap(out, counts, i, n, curve, [&](size_t j) { return dither.white(j); });
+}
+
+void HistogramImage::render(std::vector<unsigned char> &rgb, double scale, double exponent,
+    unsigned threads, Dither dither)
+{
+    Exposure e = { scale, exponent, &rgb };
+    render(std::vector<Exposure>(1, e), threads, dither);
+}
+
+void HistogramImage::render(const std::vector<Exposure> &exposures, unsigned threads, Dither options)
 {
     // Tone mapping from 64-bit-per-channel to 8-bit-per-channel, with dithering.
 
-    PRNG rng;
-    rng.seed(0);
+    std::vector<ToneCurve> curves;
+    std::vector<unsigned char*> outputs;
+    for (unsigned e = 0; e < exposures.size(); ++e) {
+        exposures[e].rgb->resize(mWidth * mHeight * 3);
+        curves.push_back(ToneCurve(exposures[e].scale, exposures[e].exponent));
+        outputs.push_back(&(*exposures[e].rgb)[0]);
+    }
+    DitherPattern dither(options, mWidth);
+
+    // Split the image into horizontal slices, one per thread.
+    threads = std::max(1u, std::min(threads, mHeight));
+    unsigned rows = (mHeight + threads - 1) / threads;
+    std::vector<std::thread> workers;
+
+    for (unsigned top = rows; top < mHeight; top += rows) {
+        unsigned bottom = std::min(mHeight, top + rows);
+        workers.push_back(std::thread(&HistogramImage::renderRows, this,
+            &outputs[0], &curves[0], unsigned(curves.size()), std::cref(dither), top, bottom));
+    }
+
+    renderRows(&outputs[0], &curves[0], curves.size(), dither, 0, std::min(mHeight, rows));
+
+    for (unsigned i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+double HistogramImage::exposureScale(double exposure, double lightPower, uint64_t rays) const
+{
+    /* 
+     * Exposure calculation as a backward-compatible generalization of zenphoton.com.
+     * We need to correct for differences due to resolution and due to the higher
+     * fixed-point resolution we use during histogram rendering.
+     */
+
+    double areaScale = sqrt(double(mWidth) * mHeight / (1024 * 576));
+    double intensityScale = lightPower / (255.0 * 8192.0);
+    return exp(1.0 + 10.0 * exposure) * areaScale * intensityScale / rays;
+}
+
+void HistogramImage::renderRows(unsigned char *const *rgb, const ToneCurve *curves,
+    unsigned count, const DitherPattern &dither, unsigned top, unsigned bottom)
+{
+    /*
+     * Tone map rows [top, bottom) into each of 'count' outputs. The loops are
+     * kept free of dependencies between samples so the compiler can vectorize
+     * them. Linear output is common enough (it's the zenphoton.com default) to
+     * skip pow() entirely. Note the size_t indices; GCC won't vectorize with a
+     * wrapping 32-bit index.
+     */
+
+    forEachRun(top, bottom, [&](size_t pixel, size_t counter, size_t n) {
+        size_t i = pixel * 3;
+        const Counter *counts = findCounters(counter);
+
+        if (!counts) {
+            // Untouched sparse tile
+            for (unsigned e = 0; e < count; ++e)
+                memset(rgb[e] + i, 0, n * 3);
+            return;
+        }
+
+        /*
+         * Work on a chunk of pixels at a time, small enough to stay in cache
+         * while it's mapped to every output. Three-channel counters are used
+         * as they are. Otherwise we widen them, fold in any spills, and repack
+         * to three channels: dropping RGBX padding, or giving mono pixels the
+         * same value in all three. That's exactly what a three-channel image
+         * would have held, so the output is identical.
+         */
+
+        const size_t kChunk = 256;
+        int64_t wide[kChunk * 4];
+        double noise[kChunk * 3];
+
+        for (size_t done = 0; done < n; done += kChunk) {
+            size_t m = std::min(kChunk, n - done);
+            size_t j = i + done * 3;
+            const int64_t *samples = wide;
+
+#ifndef HQZ_COMPACT_HISTOGRAM
+            if (mChannels == 3)
+                samples = counts + done * 3;
+#endif
+
+            if (samples == wide) {
+                for (size_t k = 0; k != m * mChannels; ++k)
+                    wide[k] = counts[done * mChannels + k];
+#ifdef HQZ_COMPACT_HISTOGRAM
+                addSpills(wide, counter + done * mChannels, m * mChannels);
+#endif
+                if (mChannels == 1) {
+                    // In place, from the end, so nothing is overwritten before it's read
+                    for (size_t k = m; k--;)
+                        wide[3*k + 0] = wide[3*k + 1] = wide[3*k + 2] = wide[k];
+                } else if (mChannels == 4) {
+                    // Drop the padding, from the start for the same reason
+                    for (size_t k = 0; k != m; ++k)
+                        for (unsigned ch = 0; ch < 3; ++ch)
+                            wide[3*k + ch] = wide[4*k + ch];
+                }
+            }
+
+            if (count == 1) {
+                toneMap(rgb[0] + j, samples, j, m * 3, curves[0], dither);
+                continue;
+            }
+
+            // Every output has the same dither, so compute it once
+            if (dither.blueNoise())
+                for (size_t k = 0; k != m * 3; ++k)
+                    noise[k] = dither.blue(j + k);
+            else
+                for (size_t k = 0; k != m * 3; ++k)
+                    noise[k] = dither.white(j + k);
+            for (unsigned e = 0; e < count; ++e)
+                toneMap(rgb[e] + j, samples, j, m * 3, curves[e], [&](size_t x) { return noise[x - j]; });
+        }
+    });
+}
+
+void HistogramImage::add(const HistogramImage &other, unsigned top, unsigned bottom)
+{
+    forEachRun(top, bottom, [&](size_t, size_t counter, size_t pixels) {
+        size_t n = pixels * mChannels;
+        const Counter *src = other.findCounters(counter);
+        if (!src)
+            return;
+        Counter *dest = counters(counter);
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+        for (size_t k = 0; k != n; ++k)
+            accumulate<false>(dest + k, src[k]);
+
+        // The other image's spills carry over as they are
+        for (size_t k = 0; k != n; ++k) {
+            size_t c = counter + k;
+            if (other.mSpilled[c >> 6] & (uint64_t(1) << (c & 63)))
+                spill(c, other.spillStripe(c).high.find(c)->second);
+        }
+#else
+        for (size_t k = 0; k != n; ++k)
+            dest[k] += src[k];
+#endif
+    });
+}
+
+void HistogramImage::readRows(int64_t *out, unsigned top, unsigned bottom) const
+{
+    unsigned channels = this->channels();
+    size_t first = size_t(top) * mWidth;
+
+    forEachRun(top, bottom, [&](size_t pixel, size_t counter, size_t n) {
+        int64_t *dest = out + (pixel - first) * channels;
+        const Counter *src = findCounters(counter);
+
+        if (!src) {
+            memset(dest, 0, n * channels * sizeof *dest);
+            return;
+        }
+
+        for (size_t p = 0; p != n; ++p)
+            for (unsigned ch = 0; ch < channels; ++ch)
+                dest[p * channels + ch] = src[p * mChannels + ch];
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+        for (size_t p = 0; p != n; ++p)
+            addSpills(dest + p * channels, counter + p * mChannels, channels);
+#endif
+    });
+}
+
+void HistogramImage::addRows(const int64_t *in, unsigned top, unsigned bottom)
+{
+    unsigned channels = this->channels();
+    size_t first = size_t(top) * mWidth;
+
+    forEachRun(top, bottom, [&](size_t pixel, size_t counter, size_t n) {
+        const int64_t *src = in + (pixel - first) * channels;
+
+        // Leave sparse tiles unallocated if there's nothing to add
+        bool empty = true;
+        for (size_t k = 0; k != n * channels; ++k)
+            empty &= src[k] == 0;
+        if (empty)
+            return;
+
+        Counter *dest = counters(counter);
+        for (size_t p = 0; p != n; ++p)
+            for (unsigned ch = 0; ch < channels; ++ch) {
+#ifdef HQZ_COMPACT_HISTOGRAM
+                // The low 32 bits add normally, and the rest goes straight to a spill
+                int64_t v = src[p * channels + ch];
+                int32_t low = int32_t(uint32_t(v));
+                accumulate<false>(dest + p * mChannels + ch, low);
+                if (v != low)
+                    spill(counter + p * mChannels + ch, v - low);
+#else
+                dest[p * mChannels + ch] += src[p * channels + ch];
+#endif
+            }
+    });
+}
+
+template <unsigned kChannels, bool kAtomic, bool kWindow>
+inline void HistogramImage::plot(const Color &c, Counter *ptr, int intensity,
+    unsigned row, unsigned top, unsigned bottom)
+{
+    // Mono images only hold white light, where r == g == b.
+
+    if (kWindow && (row < top || row >= bottom))
+        return;
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+    accumulate<kAtomic>(ptr + 0, c.r * intensity);
+    if (kChannels != 1) {
+        accumulate<kAtomic>(ptr + 1, c.g * intensity);
+        accumulate<kAtomic>(ptr + 2, c.b * intensity);
+    }
+#else
+    if (kChannels == 1) {
+        if (kAtomic)
+            __atomic_fetch_add(ptr, int64_t(c.r * intensity), __ATOMIC_RELAXED);
+        else
+            *ptr += c.r * intensity;
+    } else if (kAtomic)
+        c.plotAtomic(ptr, intensity);
+    else
+        c.plot(ptr, intensity);
+#endif
+}
+
+#ifdef HQZ_SIMD_RASTERIZER
+
+static inline size_t __attribute__((always_inline)) interiorSIMD(const Color &c, int64_t *ptr,
+    size_t steps, double &intery, double gradient, double br, size_t hx, size_t hy)
+{
+    /*
+     * Vectorized version of the inner loop of Wu's algorithm, for several
+     * consecutive major-axis steps at a time. Returns the number of steps
+     * handled; the scalar loop finishes the rest.
+     *
+     * To match the scalar loop bit for bit, 'intery' is still advanced by
+     * repeated addition, one lane at a time. Everything downstream of it
+     * (truncation, coverage, the integer color products) is the same
+     * arithmetic in each lane. Within one group every pixel we touch is
+     * at a different major-axis position, so none of the adds collide.
+     */
+
+    const __m128i r = _mm_set1_epi32(c.r);
+    const __m128i g = _mm_set1_epi32(c.g);
+    const __m128i b = _mm_set1_epi32(c.b);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d vbr = _mm256_set1_pd(br);
+    size_t done = 0;
+
+#ifdef __AVX512F__
+    /*
+     * AVX-512: eight steps per iteration, with gather/scatter for the
+     * histogram updates. Conversions and gathers use the masked forms with
+     * every lane enabled: the plain ones start from an undefined register,
+     * which GCC reports as possibly uninitialized.
+     */
 
-    unsigned i = 0;
-    unsigned e = mWidth * mHeight * kChannels; 
-    rgb.resize(e);
+    const __mmask8 all = 0xff;
+
+    const __m512d one8 = _mm512_set1_pd(1.0);
+    const __m512d br8 = _mm512_set1_pd(br);
+    const __m512i hy8 = _mm512_set1_epi64(hy);
+    const __m512i lanes = _mm512_maskz_mul_epu32(all, _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7),
+        _mm512_set1_epi64(hx));
+    const __m256i color8[3] = {
+        _mm256_set1_epi32(c.r), _mm256_set1_epi32(c.g), _mm256_set1_epi32(c.b) };
+
+    for (; done + 8 <= steps; done += 8) {
+        double y[8];
+        for (unsigned k = 0; k < 8; ++k) {
+            y[k] = intery;
+            intery += gradient;
+        }
 
-    for (; i != e; ++i) {
-        double u = std::max(0.0, mCounts[i] * scale);
-        double dither = rng.uniform();
-        double v = 255.0 * pow(u, exponent) + dither;
-        rgb[i] = std::max(0.0, std::min(255.9, v));
+        __m512d vy = _mm512_loadu_pd(y);
+        __m256i iy = _mm512_maskz_cvttpd_epi32(all, vy);
+        __m512d fy = _mm512_sub_pd(vy, _mm512_maskz_cvtepi32_pd(all, iy));
+        __m256i w0 = _mm512_maskz_cvttpd_epi32(all, _mm512_mul_pd(br8, _mm512_sub_pd(one8, fy)));
+        __m256i w1 = _mm512_maskz_cvttpd_epi32(all, _mm512_mul_pd(br8, fy));
+
+        __m512i offset0 = _mm512_add_epi64(_mm512_add_epi64(lanes, _mm512_set1_epi64(done * hx)),
+            _mm512_maskz_mul_epu32(all, _mm512_maskz_cvtepi32_epi64(all, iy), hy8));
+        __m512i offset1 = _mm512_add_epi64(offset0, hy8);
+
+        for (unsigned ch = 0; ch < 3; ++ch) {
+            // 32-bit products, sign extended, like Color::plot()
+            __m512i p0 = _mm512_maskz_cvtepi32_epi64(all, _mm256_mullo_epi32(w0, color8[ch]));
+            __m512i p1 = _mm512_maskz_cvtepi32_epi64(all, _mm256_mullo_epi32(w1, color8[ch]));
+            long long *base = (long long *) (ptr + ch);
+
+            __m512i v0 = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), all, offset0, base, 8);
+            _mm512_i64scatter_epi64(base, offset0, _mm512_add_epi64(v0, p0), 8);
+            __m512i v1 = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), all, offset1, base, 8);
+            _mm512_i64scatter_epi64(base, offset1, _mm512_add_epi64(v1, p1), 8);
+        }
     }
+#endif
+
+    /*
+     * AVX2: four steps per iteration. There's no scatter, so the products
+     * are computed in vector registers and added to the histogram one
+     * pixel at a time.
+     */
+
+    for (; done + 4 <= steps; done += 4) {
+        double y[4];
+        for (unsigned k = 0; k < 4; ++k) {
+            y[k] = intery;
+            intery += gradient;
+        }
+
+        __m256d vy = _mm256_loadu_pd(y);
+        __m128i iy = _mm256_cvttpd_epi32(vy);
+        __m256d fy = _mm256_sub_pd(vy, _mm256_cvtepi32_pd(iy));
+        __m128i w0 = _mm256_cvttpd_epi32(_mm256_mul_pd(vbr, _mm256_sub_pd(one, fy)));
+        __m128i w1 = _mm256_cvttpd_epi32(_mm256_mul_pd(vbr, fy));
+
+        int rows[4], p[6][4];
+        _mm_storeu_si128((__m128i*) rows, iy);
+        _mm_storeu_si128((__m128i*) p[0], _mm_mullo_epi32(w0, r));
+        _mm_storeu_si128((__m128i*) p[1], _mm_mullo_epi32(w0, g));
+        _mm_storeu_si128((__m128i*) p[2], _mm_mullo_epi32(w0, b));
+        _mm_storeu_si128((__m128i*) p[3], _mm_mullo_epi32(w1, r));
+        _mm_storeu_si128((__m128i*) p[4], _mm_mullo_epi32(w1, g));
+        _mm_storeu_si128((__m128i*) p[5], _mm_mullo_epi32(w1, b));
+
+        for (unsigned k = 0; k < 4; ++k) {
+            int64_t *py = ptr + (done + k) * hx + size_t(rows[k]) * hy;
+            py[0] += p[0][k];
+            py[1] += p[1][k];
+            py[2] += p[2][k];
+            py[hy + 0] += p[3][k];
+            py[hy + 1] += p[4][k];
+            py[hy + 2] += p[5][k];
+        }
+    }
+
+    return done;
 }
 
+#endif  // HQZ_SIMD_RASTERIZER
+
 void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
+{
+    if (mChannels == 1) {
+        if (mAtomic)
+            rasterize<1, true, false>(c, x0, y0, x1, y1, 0, 0);
+        else
+            rasterize<1, false, false>(c, x0, y0, x1, y1, 0, 0);
+    } else {
+        if (mAtomic)
+            rasterize<kColorCounters, true, false>(c, x0, y0, x1, y1, 0, 0);
+        else
+            rasterize<kColorCounters, false, false>(c, x0, y0, x1, y1, 0, 0);
+    }
+}
+
+void HistogramImage::line(Color c, double x0, double y0, double x1, double y1,
+    unsigned top, unsigned bottom)
+{
+    if (mChannels == 1) {
+        if (mAtomic)
+            rasterize<1, true, true>(c, x0, y0, x1, y1, top, bottom);
+        else
+            rasterize<1, false, true>(c, x0, y0, x1, y1, top, bottom);
+    } else {
+        if (mAtomic)
+            rasterize<kColorCounters, true, true>(c, x0, y0, x1, y1, top, bottom);
+        else
+            rasterize<kColorCounters, false, true>(c, x0, y0, x1, y1, top, bottom);
+    }
+}
+
+template <unsigned kChannels, bool kAtomic, bool kWindow>
+void HistogramImage::rasterize(Color c, double x0, double y0, double x1, double y1,
+    unsigned top, unsigned bottom)
 {
     /*
      * Modified version of Xiaolin Wu's antialiased line algorithm:
@@ -74,8 +756,7 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
      *   We scale the brightness of each pixel to compensate.
      */
 
-    unsigned hx = kChannels;
-    unsigned hy = kChannels * mWidth;
+    bool swapped = false;
     double limitX = mWidth - 1.0001;
     double limitY = mHeight - 1.0001;
     {
@@ -88,8 +769,8 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
             // Axis swap. The virtual 'x' is always the major axis.
             std::swap(x0, y0);
             std::swap(x1, y1);
-            std::swap(hx, hy);
             std::swap(limitX, limitY);
+            swapped = true;
         }
     }
 
@@ -106,6 +787,11 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
     {
         double dx = x1 - x0;
         double dy = y1 - y0;
+
+        // Zero-length lines have no brightness, and no defined slope.
+        // (Can't rely on the isnan() checks below under -ffast-math.)
+        if (!(dx > 0.0)) return;
+
         gradient = dy / dx;
         br = 128.0 * sqrt(dx*dx + dy*dy) / dx;
     }
@@ -167,6 +853,39 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
     if (isnan(x1)) return;
     if (isnan(y1)) return;
 
+    /*
+     * Pixels are addressed by (major, minor) coordinates, which may be
+     * swapped relative to (x, y). Windowing is by image row.
+     */
+
+#ifdef HQZ_TILED_HISTOGRAM
+    auto pixel = [&](unsigned major, unsigned minor) {
+        return swapped ? counterAt(minor, major) : counterAt(major, minor);
+    };
+
+    // The pixel at (major, minor + 1), given the one at (major, minor)
+    auto next = [&](Counter *, unsigned major, unsigned minor) {
+        return pixel(major, minor + 1);
+    };
+#else
+    size_t hx = kChannels;
+    size_t hy = kChannels * size_t(mWidth);
+    if (swapped)
+        std::swap(hx, hy);
+
+    auto pixel = [&](unsigned major, unsigned minor) {
+        return &mCounts[major * hx + minor * hy];
+    };
+
+    auto next = [&](Counter *p, unsigned, unsigned) {
+        return p + hy;
+    };
+#endif
+
+    auto row = [&](unsigned major, unsigned minor) {
+        return swapped ? major : minor;
+    };
+
     // First endpoint
 
     double x05 = x0 + 0.5;
@@ -176,9 +895,8 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
     double xgap = br * (1.0 - x05 + xend);
     int ypxl1 = yend;
     double t = yend - int(yend);
-    int64_t *ptr = &mCounts[ xpxl1 * hx + ypxl1 * hy ];
-    c.plot(ptr, xgap * (1.0 - t));
-    c.plot(ptr + hy, xgap * t);
+    plot<kChannels, kAtomic, kWindow>(c, pixel(xpxl1, ypxl1), xgap * (1.0 - t), row(xpxl1, ypxl1), top, bottom);
+    plot<kChannels, kAtomic, kWindow>(c, pixel(xpxl1, ypxl1 + 1), xgap * t, row(xpxl1, ypxl1 + 1), top, bottom);
     double intery = yend + gradient;
 
     // Second endpoint
@@ -190,24 +908,76 @@ void HistogramImage::line(Color c, double x0, double y0, double x1, double y1)
     xgap = br * (x15 - t);
     int ypxl2 = yend;
     t = yend - int(yend);
-    ptr = &mCounts[ xpxl2 * hx + ypxl2 * hy ];
-    c.plot(ptr, xgap * (1.0 - t));
-    c.plot(ptr + hy, xgap * t);
+    plot<kChannels, kAtomic, kWindow>(c, pixel(xpxl2, ypxl2), xgap * (1.0 - t), row(xpxl2, ypxl2), top, bottom);
+    plot<kChannels, kAtomic, kWindow>(c, pixel(xpxl2, ypxl2 + 1), xgap * t, row(xpxl2, ypxl2 + 1), top, bottom);
 
     // Inner loop
 
-    ptr = &mCounts[ (xpxl1 + 1) * hx ];
-    int64_t *ptrEnd = &mCounts[ xpxl2 * hx ];
+    unsigned x = xpxl1 + 1;
+    unsigned xEnd = std::max(xpxl2, xpxl1 + 1);
+
+#ifdef HQZ_SIMD_RASTERIZER
+    // Atomic, windowed and mono plots stay scalar
+    if (!kAtomic && !kWindow && kChannels != 1)
+        x += interiorSIMD(c, pixel(x, 0), xEnd - x, intery, gradient, br, hx, hy);
+#endif
 
-    while (ptr < ptrEnd) {
+#ifdef HQZ_FIXED_DDA
+    /*
+     * Brightness gets 16 fraction bits of its own, so each weight is one
+     * multiply and a shift: at most 2^32 * 2^24, well within 64 bits.
+     *
+     * The position carries another 32 bits of fraction in a separate word,
+     * like the error term in Bresenham's algorithm, so a rounded step never
+     * accumulates: after even 2^32 steps the position is within one fixed
+     * point unit of the exact line, and lands on the same pixels as the
+     * floating point loop. The clamp only catches that last unit at the
+     * edges of the clipped range.
+     *
+     * Weights are taken at the middle of the fixed point unit the position
+     * falls in, so their rounding error isn't biased towards either pixel.
+     */
+
+    const int kBits = HQZ_FIXED_DDA;
+    const int64_t kOne = int64_t(1) << kBits;
+    const double kCarryOne = 4294967296.0;
+
+    // Scaling by a power of two is exact, and so is splitting off the fraction
+    double startY = intery * kOne;
+    double stepY = gradient * kOne;
+    int64_t fixedY = floor(startY);
+    int64_t fixedStep = floor(stepY);
+    uint32_t carryY = std::min((startY - fixedY) * kCarryOne, kCarryOne - 1);
+    uint32_t carryStep = std::min((stepY - fixedStep) * kCarryOne + 0.5, kCarryOne - 1);
+
+    int64_t fixedMax = limitY * kOne;
+    uint64_t fixedBr = br * 65536.0;
+
+    for (; x < xEnd; ++x) {
+        uint64_t y = std::min(fixedMax, std::max<int64_t>(0, fixedY));
+        uint64_t fy = y & (kOne - 1);
+        unsigned iy = y >> kBits;
+        Counter *py = pixel(x, iy);
+
+        plot<kChannels, kAtomic, kWindow>(c, py, ((2 * (kOne - fy) - 1) * fixedBr) >> (kBits + 17),
+            row(x, iy), top, bottom);
+        plot<kChannels, kAtomic, kWindow>(c, next(py, x, iy), ((2 * fy + 1) * fixedBr) >> (kBits + 17),
+            row(x, iy + 1), top, bottom);
+
+        uint32_t carry = carryY + carryStep;
+        fixedY += fixedStep + (carry < carryY);
+        carryY = carry;
+    }
+#else
+    for (; x < xEnd; ++x) {
         unsigned iy = intery;
         double fy = intery - iy;
-        int64_t *py = ptr + iy * hy;
+        Counter *py = pixel(x, iy);
 
-        c.plot(py, br * (1.0 - fy));
-        c.plot(py + hy, br * fy);
+        plot<kChannels, kAtomic, kWindow>(c, py, br * (1.0 - fy), row(x, iy), top, bottom);
+        plot<kChannels, kAtomic, kWindow>(c, next(py, x, iy), br * fy, row(x, iy + 1), top, bottom);
 
-        ptr += hx;
         intery += gradient;
     }
+#endif
 }
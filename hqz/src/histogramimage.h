@@ -28,24 +28,289 @@
 #pragma once
 #include <stdint.h>
 #include <math.h>
+#include <stdlib.h>
 #include <vector>
 #include <algorithm>
 #include "spectrum.h"
 
+/*
+ * Build with -DHQZ_SPARSE_HISTOGRAM to allocate tiles only when something is
+ * first plotted in them, so memory use follows the lit area of the image
+ * rather than its size. This implies the tiled layout. It can't be used with
+ * compact counters, which identify a counter by its offset in one array.
+ */
+
+#ifdef HQZ_SPARSE_HISTOGRAM
+#ifdef HQZ_COMPACT_HISTOGRAM
+#error "HQZ_SPARSE_HISTOGRAM can't be combined with HQZ_COMPACT_HISTOGRAM"
+#endif
+#ifndef HQZ_TILED_HISTOGRAM
+#define HQZ_TILED_HISTOGRAM
+#endif
+#endif
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#endif
+
+
+class ToneCurve;
+class DitherPattern;
+
+// Allocates on cache line boundaries
+template <typename T> struct CacheAlignedAllocator {
+    typedef T value_type;
+
+    CacheAlignedAllocator() {}
+    template <typename U> CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+    T *allocate(size_t n) { return (T*) aligned_alloc(64, (n * sizeof(T) + 63) & ~size_t(63)); }
+    void deallocate(T *p, size_t) { free(p); }
+
+    bool operator==(const CacheAlignedAllocator &) const { return true; }
+    bool operator!=(const CacheAlignedAllocator &) const { return false; }
+};
+
 
 class HistogramImage
 {
 public:
-    void resize(unsigned w, unsigned h);
+    HistogramImage() : mWidth(0), mHeight(0), mChannels(kColorCounters), mAtomic(false), mExternal(0) {}
+
+    // A mono image keeps one channel per pixel, for scenes where every ray is
+    // white. It renders to the same RGB output as a color image would.
+    void resize(unsigned w, unsigned h, bool mono = false);
     void clear();
-    void render(std::vector<unsigned char> &rgb, double scale, double exponent);
+    /*
+     * Dithering for render(). Dither is a function of each sample's position
+     * and channel, and the frame number, so it's the same however rendering
+     * is split up, and each frame of an animation gets its own pattern.
+     * Blue noise has finer grain than the default white noise.
+     */
+    struct Dither {
+        uint32_t frame;
+        bool blueNoise;
+    };
+
+    void render(std::vector<unsigned char> &rgb, double scale, double exponent,
+        unsigned threads = 1, Dither dither = Dither());
+
+    /*
+     * Tone map several variants of the image at once, for exposure
+     * bracketing. Each chunk of counters is read from memory once and
+     * mapped to every output while it's in cache. Each output is the
+     * same as a separate render() with that scale and exponent.
+     */
+    struct Exposure {
+        double scale, exponent;
+        std::vector<unsigned char> *rgb;
+    };
+
+    void render(const std::vector<Exposure> &exposures, unsigned threads = 1, Dither dither = Dither());
+
+    // The render() scale for a scene's exposure and total light power, after tracing 'rays' rays
+    double exposureScale(double exposure, double lightPower, uint64_t rays) const;
+
     void line(Color color, double x0, double y0, double x1, double y1);
 
+    // Only plot the parts of a line that fall within rows [top, bottom).
+    // Lines split across bands this way add up to exactly the same image.
+    void line(Color color, double x0, double y0, double x1, double y1,
+        unsigned top, unsigned bottom);
+
+    // In atomic mode, line() may be called concurrently from many threads.
+    void setAtomic(bool atomic) { mAtomic = atomic; }
+
+    // Memory needed for the counters of a w x h image. Sparse images may use less.
+    static uint64_t bytesFor(unsigned w, unsigned h, bool mono = false) {
+        return uint64_t(padded(w)) * padded(h) * (mono ? 1 : kColorCounters) * sizeof(Counter);
+    }
+
+    // Sum rows [top, bottom) of another image with the same dimensions into this one
+    void add(const HistogramImage &other, unsigned top, unsigned bottom);
+
     unsigned width() const { return mWidth; }
     unsigned height() const { return mHeight; }
+    bool mono() const { return mChannels == 1; }
+
+    /*
+     * Counters for rows [top, bottom) in a plain layout, whatever the build:
+     * row-major, channels() 64-bit counters per pixel. This is how they're
+     * stored in histogram files. Only use these while nobody is plotting.
+     */
+    unsigned channels() const { return mono() ? 1 : 3; }
+    void readRows(int64_t *out, unsigned top, unsigned bottom) const;
+    void addRows(const int64_t *in, unsigned top, unsigned bottom);
+
+    /*
+     * Use 'counts', in that same plain layout, as this image's counters
+     * without copying them. A wrapped image can be rendered and read, but
+     * not plotted into, and 'counts' must outlive it. resize() lets go.
+     * Returns false if this build's layout isn't the plain one.
+     */
+    bool wrap(const int64_t *counts, unsigned w, unsigned h, bool mono);
 
 private:
-    static const unsigned kChannels = 3;
+    /*
+     * Build with -DHQZ_COMPACT_HISTOGRAM for 32-bit counters, halving the
+     * histogram's size and memory traffic. Totals stay exact: when an add
+     * overflows a counter, the counter keeps the wrapped value and the
+     * lost multiple of 2^32 is recorded in a sparse spill table. Only the
+     * brightest pixels of long renders ever spill.
+     */
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+    typedef int32_t Counter;
+#else
+    typedef int64_t Counter;
+#endif
+
+    /*
+     * Counters per pixel in color images. Build with -DHQZ_RGBX_HISTOGRAM to
+     * pad each pixel to four, matching Color, so that it's one aligned
+     * 256-bit vector. The fourth counter is always zero.
+     */
+
+#ifdef HQZ_RGBX_HISTOGRAM
+    static constexpr unsigned kColorCounters = 4;
+#else
+    static constexpr unsigned kColorCounters = 3;
+#endif
+
     uint32_t mWidth, mHeight;
-    std::vector<int64_t> mCounts;
+    unsigned mChannels;     // Counters per pixel: 1 if mono, else kColorCounters
+    bool mAtomic;
+    const Counter *mExternal;   // Set by wrap(), instead of our own counters
+
+#ifdef HQZ_SPARSE_HISTOGRAM
+    // One pointer per tile, null until the tile is first plotted
+    struct TileTable {
+        std::vector<Counter*> tiles;
+
+        TileTable() {}
+        TileTable(TileTable &&) = default;
+        ~TileTable() { reset(0); }
+
+        void reset(size_t n) {
+            for (size_t i = 0; i < tiles.size(); ++i)
+                free(tiles[i]);
+            tiles.assign(n, 0);
+        }
+    };
+
+    TileTable mTiles;
+    Counter *allocTile(size_t t);
+
+    Counter *tile(size_t t) {
+        Counter *p = __atomic_load_n(&mTiles.tiles[t], __ATOMIC_ACQUIRE);
+        return __builtin_expect(p != 0, 1) ? p : allocTile(t);
+    }
+#else
+    std::vector<Counter, CacheAlignedAllocator<Counter> > mCounts;
+#endif
+
+#ifdef HQZ_COMPACT_HISTOGRAM
+    // Spill table, split into independently locked stripes
+    struct SpillStripe {
+        std::mutex lock;
+        std::unordered_map<size_t, int64_t> high;
+    };
+
+    static constexpr unsigned kSpillStripes = 64;
+    std::unique_ptr<SpillStripe[]> mSpill;
+    std::vector<uint64_t> mSpilled;         // One bit per counter with a spill entry
+
+    SpillStripe &spillStripe(size_t counter) const { return mSpill[(counter >> 6) % kSpillStripes]; }
+    void spill(size_t counter, int64_t amount);
+    void addSpills(int64_t *values, size_t counter, size_t n) const;
+    template <bool kAtomic> void accumulate(Counter *ptr, int32_t value);
+#endif
+
+    /*
+     * Build with -DHQZ_TILED_HISTOGRAM to store counters in square tiles
+     * instead of rows. Each tile is contiguous, so a steep line stays in
+     * the same few cache lines and pages for up to a tile's height,
+     * instead of touching a new row every pixel. The image is padded to a
+     * whole number of tiles. Rendered output is identical either way.
+     */
+
+#ifdef HQZ_TILED_HISTOGRAM
+    static constexpr unsigned kTileBits = 4;
+    static constexpr unsigned kTileSize = 1 << kTileBits;
+    static constexpr unsigned kTileMask = kTileSize - 1;
+    uint32_t mTilesX;
+
+    static unsigned padded(unsigned n) { return (n + kTileMask) & ~kTileMask; }
+    size_t tileCounters() const { return size_t(kTileSize) * kTileSize * mChannels; }
+#else
+    static unsigned padded(unsigned n) { return n; }
+#endif
+
+    // Index of the first counter of pixel (x, y), in tile order if tiled
+    size_t index(unsigned x, unsigned y) const {
+#ifdef HQZ_TILED_HISTOGRAM
+        size_t tile = size_t(y >> kTileBits) * mTilesX + (x >> kTileBits);
+        return ((tile << (2 * kTileBits)) | ((y & kTileMask) << kTileBits) | (x & kTileMask)) * mChannels;
+#else
+        return (size_t(y) * mWidth + x) * mChannels;
+#endif
+    }
+
+    /*
+     * Counters [i, i + n) for a run from forEachRun(). counters() allocates
+     * sparse tiles as needed. findCounters() returns null if the tile hasn't
+     * been touched, in which case all its counters are zero.
+     */
+    Counter *counters(size_t i) {
+#ifdef HQZ_SPARSE_HISTOGRAM
+        return tile(i / tileCounters()) + i % tileCounters();
+#else
+        return &mCounts[i];
+#endif
+    }
+
+    const Counter *findCounters(size_t i) const {
+#ifdef HQZ_SPARSE_HISTOGRAM
+        const Counter *p = mTiles.tiles[i / tileCounters()];
+        return p ? p + i % tileCounters() : 0;
+#else
+        return mExternal ? mExternal + i : &mCounts[i];
+#endif
+    }
+
+    // Counters for pixel (x, y), allocating if need be
+    Counter *counterAt(unsigned x, unsigned y) {
+#ifdef HQZ_SPARSE_HISTOGRAM
+        return tile(size_t(y >> kTileBits) * mTilesX + (x >> kTileBits))
+            + (((y & kTileMask) << kTileBits) | (x & kTileMask)) * mChannels;
+#else
+        return &mCounts[index(x, y)];
+#endif
+    }
+
+    /*
+     * Visit rows [top, bottom) as runs of pixels which are contiguous both
+     * in the histogram and in a row-major image, calling fn(pixel, counter, n)
+     * with the run's row-major pixel index, the index of its first counter,
+     * and its length in pixels.
+     */
+    template <typename Fn> void forEachRun(unsigned top, unsigned bottom, Fn fn) const {
+#ifdef HQZ_TILED_HISTOGRAM
+        for (unsigned y = top; y < bottom; ++y)
+            for (unsigned x = 0; x < mWidth; x += kTileSize)
+                fn(size_t(y) * mWidth + x, index(x, y), std::min(kTileSize, mWidth - x));
+#else
+        size_t begin = size_t(top) * mWidth;
+        fn(begin, begin * mChannels, size_t(bottom - top) * mWidth);
+#endif
+    }
+
+    void renderRows(unsigned char *const *rgb, const ToneCurve *curves, unsigned count,
+        const DitherPattern &dither, unsigned top, unsigned bottom);
+    template <unsigned kChannels, bool kAtomic, bool kWindow> void plot(const Color &c,
+        Counter *ptr, int intensity, unsigned row, unsigned top, unsigned bottom);
+    template <unsigned kChannels, bool kAtomic, bool kWindow> void rasterize(Color c,
+        double x0, double y0, double x1, double y1, unsigned top, unsigned bottom);
 };
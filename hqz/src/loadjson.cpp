@@ -2,10 +2,10 @@
 
 #include "rapidjson/document.h"
 #include "rapidjson/reader.h"
-#include "rapidjson/filestream.h"
 
 
 #include <sstream>
+#include <string>
 
 typedef rapidjson::Value Value;
 
@@ -141,9 +141,16 @@ Sample new_sample(const Value &v) {
 
 ZScene parseJson(FILE *scene_f) {
     fprintf(stderr, "Opening Scene\n");
-    rapidjson::FileStream istr(scene_f);
+
+    // Read the whole text first, so we can identify the scene by its hash.
+    std::string text;
+    char buffer[65536];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof buffer, scene_f)) > 0)
+        text.append(buffer, length);
+
     rapidjson::Document scene;
-    scene.ParseStream<0>(istr);
+    scene.Parse<0>(text.c_str());
     if (scene.HasParseError()) {
         fprintf(stderr, "Parse error at character %ld: %s\n",
             scene.GetErrorOffset(), scene.GetParseError());
@@ -153,6 +160,11 @@ ZScene parseJson(FILE *scene_f) {
     // Create Output
     ZScene output;
 
+    // 64-bit FNV-1a
+    output.hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < text.size(); ++i)
+        output.hash = (output.hash ^ (unsigned char) text[i]) * 0x100000001b3ull;
+
     fprintf(stderr, "Reading Scene Globals\n");
     const Value& resolution = scene["resolution"];    
     if (checkTuple(resolution, "resolution", 2)) {
@@ -165,7 +177,7 @@ ZScene parseJson(FILE *scene_f) {
     output.debug = checkInteger(scene["debug"], "debug");
     output.seed = checkInteger(scene["seed"], "seed");
     output.rays = checkInteger(scene["rays"], "rays");
-    output.timelimit = checkInteger(scene["rays"], "rays");
+    output.timelimit = checkNumber(scene["timelimit"], "timelimit");
 
     // Other cached tuples
     if (checkTuple(scene["viewport"], "viewport", 4)) {
@@ -1605,7 +1605,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, int final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
@@ -1617,7 +1617,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1970,7 +1970,7 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
 }
 
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+                                 const LodePNGCompressSettings* settings, int last)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
@@ -1978,7 +1978,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   Hash hash;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize, last);
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
@@ -1994,7 +1994,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   for(i = 0; i < numdeflateblocks && !error; i++)
   {
-    int final = i == numdeflateblocks - 1;
+    int final = last && i == numdeflateblocks - 1;
     size_t start = i * blocksize;
     size_t end = start + blocksize;
     if(end > insize) end = insize;
@@ -2003,6 +2003,18 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
     else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
   }
 
+  /*an open stream ends with an empty stored block, which pads it to a byte boundary (like zlib's sync flush)*/
+  if(!last && !error && settings->btype != 0)
+  {
+    addBitToStream(&bp, out, 0); /*BFINAL*/
+    addBitToStream(&bp, out, 0); /*BTYPE 00*/
+    addBitToStream(&bp, out, 0);
+    ucvector_push_back(out, 0); /*LEN*/
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255); /*NLEN*/
+    ucvector_push_back(out, 255);
+  }
+
   hash_cleanup(&hash);
 
   return error;
@@ -2011,11 +2023,18 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings)
+{
+  return lodepng_deflate_part(out, outsize, in, insize, settings, 1);
+}
+
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned last)
 {
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
+  error = lodepng_deflatev(&v, in, insize, settings, last);
   *out = v.data;
   *outsize = v.size;
   return error;
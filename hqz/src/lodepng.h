@@ -773,6 +773,16 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Compress one piece of a larger deflate stream. If last is 0, no block is marked
+final and the output ends byte-aligned with an empty stored block, so pieces
+compressed independently (e.g. on separate threads) can be concatenated, with
+only the last one having last set. Each piece starts with an empty LZ77 window.
+*/
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned last);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -25,22 +25,23 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include "cmdline.h"
 #include "loadjson.h"
 #include "lodepng.h"
+#include "pngencoder.h"
 #include "zrender.h"
+#include "ztopology.h"
 #include <signal.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <cstdio>
+#include <string>
 #include <vector>
-#include <thread>
 
 static ZRender *interruptibleRenderer = 0;
 
-typedef struct {
-    std::thread *thread;
-    ZRender *zr;
-} ThreadRuntime;
-
 void handleSigint(int)
 {
     static const char message[] = "\nInterrupted! Finishing up...\n";
@@ -56,85 +57,277 @@ void handleSigint(int)
     }
 }
 
+static void usage()
+{
+    fprintf(stderr,
+        "\n"
+        "High Quality Zen: The batch renderer for Zen photon garden\n"
+        "\n"
+        "usage: hqz [options] <scene.json> <output.png>\n"
+        "  (Either may be \"-\" for stdin/stdout)\n"
+        "\n"
+        "options:\n"
+        "  -t, --threads N     Trace rays on N threads (default: one per CPU we\n"
+        "                      may use, limited by any cgroup CPU quota)\n"
+        "  -m, --memory MB     Memory budget for per-thread histograms. Above this,\n"
+        "                      threads share one histogram with atomic adds.\n"
+        "                      (default: half of physical memory or of the\n"
+        "                      cgroup memory limit, whichever is smaller)\n"
+        "  -N, --numa          Pin threads to NUMA nodes, with node-local scene\n"
+        "                      data and histograms\n"
+        "  -p, --pipeline N    Rasterize on N separate threads, each owning a band\n"
+        "                      of the image, fed by the tracing threads\n"
+        "  -b, --batch N       Buffer N line segments per thread, and draw them\n"
+        "                      sorted by screen tile for better cache locality\n"
+        "  -f, --frame N       Animation frame number. Each frame gets its own\n"
+        "                      dither pattern. (default: 0)\n"
+        "      --blue-noise    Dither with blue noise instead of white noise\n"
+        "  -H, --histogram FILE  Also save the raw histogram, for re-exposing\n"
+        "                      or merging later\n"
+        "      --seed-start N  First ray seed, instead of the scene's \"seed\"\n"
+        "      --ray-count N   Number of rays, instead of the scene's \"rays\"\n"
+        "      --shard I/N     Trace only the I'th of N equal parts of the ray\n"
+        "                      range (0 <= I < N), to merge with hqz-merge later\n"
+        "  -c, --checkpoint FILE  Save progress to FILE periodically, as a raw\n"
+        "                      histogram\n"
+        "      --checkpoint-interval SECONDS  Time between checkpoints (default: 300)\n"
+        "      --resume        Continue from the checkpoint file, if there is one\n"
+        "\n"
+        "Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>\n"
+        "https://github.com/scanlime/zenphoton\n"
+        "\n");
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 3) {
-        fprintf(stderr,
-            "\n"
-            "High Quality Zen: The batch renderer for Zen photon garden\n"
-            "\n"
-            "usage: hqz <scene.json> <output.png>\n"
-            "  (Either may be \"-\" for stdin/stdout)\n"
-            "\n"
-            "Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>\n"
-            "https://github.com/scanlime/zenphoton\n"
-            "\n");
+    static const struct option longOptions[] = {
+        { "threads", required_argument, 0, 't' },
+        { "memory", required_argument, 0, 'm' },
+        { "numa", no_argument, 0, 'N' },
+        { "pipeline", required_argument, 0, 'p' },
+        { "batch", required_argument, 0, 'b' },
+        { "frame", required_argument, 0, 'f' },
+        { "blue-noise", no_argument, 0, 'B' },
+        { "histogram", required_argument, 0, 'H' },
+        { "seed-start", required_argument, 0, 'S' },
+        { "ray-count", required_argument, 0, 'R' },
+        { "shard", required_argument, 0, 'X' },
+        { "checkpoint", required_argument, 0, 'c' },
+        { "checkpoint-interval", required_argument, 0, 'I' },
+        { "resume", no_argument, 0, 'r' },
+        { 0, 0, 0, 0 }
+    };
+
+    unsigned threads = 0;
+    double memoryMB = 0;
+    bool numa = false;
+    unsigned rasterizers = 0;
+    unsigned batch = 0;
+    HistogramImage::Dither dither = HistogramImage::Dither();
+    const char *histogramPath = 0;
+    uint32_t seedStart = 0, rayCount = 0;
+    bool hasSeedStart = false, hasRayCount = false;
+    unsigned shard = 0, shards = 0;
+    const char *checkpointPath = 0;
+    double checkpointInterval = 300;
+    bool resume = false;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:m:Np:b:f:H:c:", longOptions, 0)) != -1) {
+        switch (opt) {
+        case 't':
+            if (!parseCount(optarg, threads)) {
+                fprintf(stderr, "Thread count must be a whole number, at least 1\n");
+                return 1;
+            }
+            break;
+        case 'm':
+            memoryMB = atof(optarg);
+            if (memoryMB <= 0) {
+                fprintf(stderr, "Memory budget must be positive\n");
+                return 1;
+            }
+            break;
+        case 'N':
+            numa = true;
+            break;
+        case 'p':
+            if (!parseCount(optarg, rasterizers)) {
+                fprintf(stderr, "Rasterizer count must be a whole number, at least 1\n");
+                return 1;
+            }
+            break;
+        case 'b':
+            if (!parseCount(optarg, batch)) {
+                fprintf(stderr, "Batch size must be a whole number, at least 1\n");
+                return 1;
+            }
+            break;
+        case 'f':
+            if (!parseWhole(optarg, 0u, UINT32_MAX, dither.frame)) {
+                fprintf(stderr, "Frame must be a whole number, from 0 to %u\n", UINT32_MAX);
+                return 1;
+            }
+            break;
+        case 'B':
+            dither.blueNoise = true;
+            break;
+        case 'H':
+            histogramPath = optarg;
+            break;
+        case 'S':
+            if (!parseWhole(optarg, 0u, UINT32_MAX, seedStart)) {
+                fprintf(stderr, "Seed start must be a whole number, from 0 to %u\n", UINT32_MAX);
+                return 1;
+            }
+            hasSeedStart = true;
+            break;
+        case 'R':
+            if (!parseWhole(optarg, 1u, UINT32_MAX, rayCount)) {
+                fprintf(stderr, "Ray count must be a whole number, from 1 to %u\n", UINT32_MAX);
+                return 1;
+            }
+            hasRayCount = true;
+            break;
+        case 'X': {
+            // "I/N", both whole numbers
+            std::string arg = optarg;
+            size_t slash = arg.find('/');
+            if (slash == std::string::npos
+                || !parseWhole(arg.substr(0, slash).c_str(), 0u, UINT_MAX, shard)
+                || !parseCount(arg.substr(slash + 1).c_str(), shards)
+                || shard >= shards) {
+                fprintf(stderr, "Shard must be I/N, with 0 <= I < N\n");
+                return 1;
+            }
+            break;
+        }
+        case 'c':
+            checkpointPath = optarg;
+            break;
+        case 'I':
+            checkpointInterval = atof(optarg);
+            if (checkpointInterval <= 0) {
+                fprintf(stderr, "Checkpoint interval must be positive\n");
+                return 1;
+            }
+            break;
+        case 'r':
+            resume = true;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    if (resume && !checkpointPath) {
+        fprintf(stderr, "--resume needs a --checkpoint file\n");
         return 1;
     }
 
-    FILE *sceneF = argv[1][0] == '-' ? stdin : fopen(argv[1], "r");
+    const char *scenePath = argv[optind];
+    const char *outputPath = argv[optind + 1];
+
+    FILE *sceneF = scenePath[0] == '-' ? stdin : fopen(scenePath, "r");
     if (!sceneF) {
         perror("Error opening scene file");
         return 2;
     }
 
-    FILE *outputF = argv[2][0] == '-' ? stdout : fopen(argv[2], "wb");
+    FILE *outputF = outputPath[0] == '-' ? stdout : fopen(outputPath, "wb");
     if (!outputF) {
         perror("Error opening output file");
         return 3;
     }
 
-    std::vector<ThreadRuntime> trv;
-    int n = 10; //std::thread::hardware_concurrency();
+    if (!threads) {
+        std::vector<unsigned> cpus = ZTopology::allowedCpus();
+        unsigned quota = ZTopology::cgroupCpuQuota();
+        threads = ZTopology::defaultThreadCount();
+
+        fprintf(stderr, "Using %u thread%s (%u CPUs in affinity mask",
+            threads, threads == 1 ? "" : "s", unsigned(cpus.size()));
+        if (quota)
+            fprintf(stderr, ", cgroup quota %u CPUs", quota);
+        fprintf(stderr, ")\n");
+    }
+
     ZScene scene = parseJson(sceneF);
-    int rays = scene.rays;
-    int seed = scene.seed;
-    int rays_remaining = rays;
-
-    printf("Main: seed: %i, raycount: %d\n", seed, rays);
-    //for (int i = 0; i < n; i++) {
-    //    int r = std::min<int>(rays/n, rays_remaining);
-        //ZScene st = copy_scene(scene);
-        ZRender *zr = new ZRender(scene, seed, rays);
-        
-        if (zr->hasError()) {
-            fprintf(stderr, "Scene errors:\n%s", zr->errorText());
-            return 5;
-        }
 
-        // zr->static_render
+    /*
+     * Every ray is seeded independently, so a render of seeds [seed, seed + rays)
+     * can be split into shards that sum to exactly the same histogram.
+     */
+
+    uint32_t seed = hasSeedStart ? seedStart : scene.seed;
+    uint64_t rays = hasRayCount ? rayCount : scene.rays;
+    if (rays > UINT32_MAX) {
+        fprintf(stderr, "Ray count is limited to %u\n", UINT32_MAX);
+        return 1;
+    }
+
+    if (shards) {
+        if (rays < shards) {
+            fprintf(stderr, "Can't split %llu rays into %u shards\n", (unsigned long long) rays, shards);
+            return 1;
+        }
+        uint64_t begin = rays * shard / shards;
+        uint64_t end = rays * (shard + 1) / shards;
+        seed += uint32_t(begin);
+        rays = end - begin;
+        fprintf(stderr, "Shard %u of %u\n", shard, shards);
+    }
 
-        // trv.push_back({ NULL, zr });
+    ZRender zr(scene, seed, rays);
+    zr.setThreads(threads);
+    if (memoryMB > 0)
+        zr.setMemoryBudget(memoryMB * 1e6);
+    zr.setNuma(numa);
+    zr.setPipeline(rasterizers);
+    zr.setBatch(batch);
+    zr.setDither(dither);
 
-        // rays_remaining -= r;
-        // seed += r;
-    //}
+    if (zr.hasError()) {
+        fprintf(stderr, "Scene errors:\n%s", zr.errorText().c_str());
+        return 5;
+    }
 
-    // for (int i = 0; i < n; i++) {
-    //     std::thread *t = new std::thread(trv[i].zr->static_render, trv[i].zr);
-    //     trv[i].thread = t;
-    // }
+    if (checkpointPath) {
+        zr.setCheckpoint(checkpointPath, checkpointInterval);
 
-    // while (!trv.empty()) {
-    //     std::thread *t = trv.back().thread;
-    //     t->join();
-    //     if (trv.back().zr->hasError()) {
-    //         fprintf(stderr, "Renderer errors:\n%s", trv.back().zr->errorText());
-    //         return 7;
-    //     }   
-    //     trv.pop_back();
-    // }
+        // A missing checkpoint just means there's no progress to resume yet
+        if (resume && access(checkpointPath, F_OK) == 0 && !zr.resume(checkpointPath)) {
+            fprintf(stderr, "Can't resume: %s", zr.errorText().c_str());
+            return 8;
+        }
+    }
 
     std::vector<unsigned char> pixels;
     
     // Render, and allow Ctrl-C to interrupt at any time.
-    interruptibleRenderer = zr;
+    interruptibleRenderer = &zr;
     signal(SIGINT, handleSigint);
-    zr->render(pixels);
+    zr.render(pixels);
     interruptibleRenderer = 0;
 
+    if (histogramPath && !saveHistogram(histogramPath, zr.histogramHeader(), zr.image())) {
+        perror("Error writing histogram file");
+        return 7;
+    }
+
     std::vector<unsigned char> png;
-    lodepng::encode(png, pixels, scene.r_width, scene.r_height, LCT_RGB);
+    unsigned error = encodePng(png, pixels, scene.r_width, scene.r_height, threads);
+    if (error) {
+        fprintf(stderr, "Error encoding PNG: %s\n", lodepng_error_text(error));
+        return 6;
+    }
+
     if (1 != fwrite(&png[0], png.size(), 1, outputF)) {
         perror("Error writing output file");
         return 6;
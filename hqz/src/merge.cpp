@@ -0,0 +1,257 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "cmdline.h"
+#include "histogramfile.h"
+#include "lodepng.h"
+#include "pngencoder.h"
+#include "ztopology.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+static bool parseList(const char *arg, std::vector<double> &list)
+{
+    // Comma-separated numbers, like "0.3,0.35,0.4"
+    for (;;) {
+        char *end;
+        list.push_back(strtod(arg, &end));
+        if (end == arg)
+            return false;
+        if (!*end)
+            return true;
+        if (*end != ',')
+            return false;
+        arg = end + 1;
+    }
+}
+
+static std::string variantPath(const char *path, double exposure, double gamma)
+{
+    // Insert "-e<exposure>-g<gamma>" before the extension, if any
+    std::string p = path;
+    size_t dot = p.rfind('.');
+    size_t slash = p.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = p.size();
+
+    char suffix[64];
+    snprintf(suffix, sizeof suffix, "-e%g-g%g", exposure, gamma);
+    return p.insert(dot, suffix);
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "\n"
+        "hqz-merge: Combine partial renders of one scene into a single frame,\n"
+        "or re-expose a saved frame\n"
+        "\n"
+        "usage: hqz-merge [options] <output.png> <input.hqzh>...\n"
+        "  (Output may be \"-\" for stdout)\n"
+        "\n"
+        "Inputs are raw histograms saved by \"hqz --histogram\", from renders of\n"
+        "the same scene with different seeds. Their counters and ray counts are\n"
+        "summed, and the frame is exposed as if it were traced in one run.\n"
+        "With several exposures or gammas, every combination is written, each\n"
+        "to the output name with \"-e<exposure>-g<gamma>\" before the extension.\n"
+        "\n"
+        "options:\n"
+        "  -t, --threads N     Merge and encode on N threads (default: one per CPU)\n"
+        "  -e, --exposure LIST Comma-separated exposures (default: the scene's)\n"
+        "  -g, --gamma LIST    Comma-separated gammas (default: the scene's)\n"
+        "  -f, --frame N       Animation frame number, for dithering (default: 0)\n"
+        "      --blue-noise    Dither with blue noise instead of white noise\n"
+        "  -H, --histogram FILE  Also save the merged histogram\n"
+        "\n"
+        "Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>\n"
+        "https://github.com/scanlime/zenphoton\n"
+        "\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOptions[] = {
+        { "threads", required_argument, 0, 't' },
+        { "exposure", required_argument, 0, 'e' },
+        { "gamma", required_argument, 0, 'g' },
+        { "frame", required_argument, 0, 'f' },
+        { "blue-noise", no_argument, 0, 'B' },
+        { "histogram", required_argument, 0, 'H' },
+        { 0, 0, 0, 0 }
+    };
+
+    unsigned threads = 0;
+    HistogramImage::Dither dither = HistogramImage::Dither();
+    const char *histogramPath = 0;
+    std::vector<double> exposures, gammas;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:e:g:f:H:", longOptions, 0)) != -1) {
+        switch (opt) {
+        case 't':
+            if (!parseCount(optarg, threads)) {
+                fprintf(stderr, "Thread count must be a whole number, at least 1\n");
+                return 1;
+            }
+            break;
+        case 'e':
+            if (!parseList(optarg, exposures)) {
+                fprintf(stderr, "Exposures must be a comma-separated list of numbers\n");
+                return 1;
+            }
+            break;
+        case 'g':
+            if (!parseList(optarg, gammas)) {
+                fprintf(stderr, "Gammas must be a comma-separated list of numbers\n");
+                return 1;
+            }
+            break;
+        case 'f':
+            if (!parseWhole(optarg, 0u, UINT32_MAX, dither.frame)) {
+                fprintf(stderr, "Frame must be a whole number, from 0 to %u\n", UINT32_MAX);
+                return 1;
+            }
+            break;
+        case 'B':
+            dither.blueNoise = true;
+            break;
+        case 'H':
+            histogramPath = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+
+    if (!threads)
+        threads = ZTopology::defaultThreadCount();
+
+    const char *outputPath = argv[optind];
+    // Inputs stay mapped until we exit, since a single input may be rendered in place
+    std::vector<std::unique_ptr<HistogramFile> > inputs;
+    std::vector<const HistogramFile*> files;
+
+    for (int i = optind + 1; i < argc; ++i) {
+        inputs.push_back(std::unique_ptr<HistogramFile>(new HistogramFile));
+        if (!inputs.back()->open(argv[i])) {
+            fprintf(stderr, "Error opening histogram: %s\n", inputs.back()->errorText());
+            return 2;
+        }
+        files.push_back(inputs.back().get());
+    }
+
+    HistogramImage image;
+    HistogramHeader header;
+    std::string error;
+
+    // A saved merge has to describe its seeds as one range, so it can be merged again
+    if (!mergeHistograms(files, image, header, threads, histogramPath != 0, error)) {
+        fprintf(stderr, "Can't merge: %s\n", error.c_str());
+        return 4;
+    }
+
+    if (!header.rays) {
+        fprintf(stderr, "Can't merge: no rays were traced\n");
+        return 4;
+    }
+
+    fprintf(stderr, "Read %u histogram%s, %llu rays\n", unsigned(files.size()),
+        files.size() == 1 ? "" : "s", (unsigned long long) header.rays);
+
+    if (histogramPath && !saveHistogram(histogramPath, header, image)) {
+        perror("Error writing histogram file");
+        return 7;
+    }
+
+    /*
+     * One output per combination of exposure and gamma, all tone mapped in
+     * one pass over the counters. Gamma defaults to linear, and the exposure
+     * is normalized by the total ray count, just as in ZRender::render().
+     */
+
+    if (exposures.empty())
+        exposures.push_back(header.exposure);
+    if (gammas.empty())
+        gammas.push_back(header.gamma);
+
+    size_t variants = exposures.size() * gammas.size();
+    if (variants > 1 && outputPath[0] == '-') {
+        fprintf(stderr, "Can't write several variants to stdout\n");
+        return 1;
+    }
+
+    std::vector<std::vector<unsigned char> > pixels(variants);
+    std::vector<HistogramImage::Exposure> tones;
+    std::vector<std::string> paths;
+
+    for (size_t e = 0; e < exposures.size(); ++e)
+        for (size_t g = 0; g < gammas.size(); ++g) {
+            double gamma = gammas[g] > 0.0 ? gammas[g] : 1.0;
+            HistogramImage::Exposure t = {
+                image.exposureScale(exposures[e], header.lightPower, header.rays),
+                1.0 / gamma, &pixels[tones.size()] };
+            tones.push_back(t);
+            paths.push_back(variants > 1 ? variantPath(outputPath, exposures[e], gammas[g]) : outputPath);
+        }
+
+    image.render(tones, threads, dither);
+
+    for (size_t v = 0; v < variants; ++v) {
+        const char *path = paths[v].c_str();
+        FILE *outputF = path[0] == '-' ? stdout : fopen(path, "wb");
+        if (!outputF) {
+            perror("Error opening output file");
+            return 3;
+        }
+
+        std::vector<unsigned char> png;
+        unsigned pngError = encodePng(png, pixels[v], header.width, header.height, threads);
+        if (pngError) {
+            fprintf(stderr, "Error encoding PNG: %s\n", lodepng_error_text(pngError));
+            return 6;
+        }
+
+        if (1 != fwrite(&png[0], png.size(), 1, outputF) || (outputF != stdout && fclose(outputF))) {
+            perror("Error writing output file");
+            return 6;
+        }
+    }
+
+    return 0;
+}
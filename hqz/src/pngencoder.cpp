@@ -0,0 +1,281 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pngencoder.h"
+#include "lodepng.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+/*
+ * The image is split into horizontal pieces, which are shared out among
+ * the threads. Each piece's scanlines are filtered (the row above a piece
+ * is still available, since filters work on the unfiltered input), then
+ * deflated as a separate part of one deflate stream, with their own
+ * Adler-32. Stitching the parts together only takes a few arithmetic
+ * steps for the checksum, and a copy.
+ *
+ * Each part starts with an empty LZ77 window, so splitting costs a little
+ * compression. Pieces are kept large enough that this is negligible. Their
+ * size depends only on the image dimensions, so the file is the same for
+ * any number of threads.
+ */
+
+static const size_t kPieceBytes = 256 * 1024;
+static const uint32_t kAdlerBase = 65521;
+
+static unsigned char paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static void filterRow(unsigned char *out, const unsigned char *row, const unsigned char *prev,
+    size_t length, size_t bpp, unsigned char *scratch)
+{
+    /*
+     * Adaptive filtering with the minimum-sum-of-absolute-differences
+     * heuristic, the same one lodepng uses by default for truecolor images.
+     * Writes the filter type byte followed by 'length' filtered bytes.
+     * 'scratch' holds one trial row.
+     */
+
+    size_t bestSum = 0;
+    unsigned bestType = 0;
+
+    for (unsigned type = 0; type < 5; ++type) {
+        unsigned char *dest = type ? scratch : out + 1;
+
+        for (size_t i = 0; i < length; ++i) {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = prev ? prev[i] : 0;
+            int c = prev && i >= bpp ? prev[i - bpp] : 0;
+            int predicted;
+
+            switch (type) {
+                default: predicted = 0; break;
+                case 1: predicted = a; break;
+                case 2: predicted = b; break;
+                case 3: predicted = (a + b) / 2; break;
+                case 4: predicted = paeth(a, b, c); break;
+            }
+            dest[i] = row[i] - predicted;
+        }
+
+        // Filter type 0 isn't a difference, so it's summed unsigned.
+        size_t sum = 0;
+        for (size_t i = 0; i < length; ++i)
+            sum += type ? abs((signed char) dest[i]) : dest[i];
+
+        if (type == 0 || sum < bestSum) {
+            bestSum = sum;
+            bestType = type;
+            if (type)
+                memcpy(out + 1, scratch, length);
+        }
+    }
+
+    out[0] = bestType;
+}
+
+static uint32_t adler32(const unsigned char *data, size_t len)
+{
+    uint32_t s1 = 1, s2 = 0;
+
+    while (len) {
+        // Largest n such that s2 can't overflow before the modulo
+        size_t n = std::min<size_t>(len, 5552);
+        len -= n;
+        while (n--) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= kAdlerBase;
+        s2 %= kAdlerBase;
+    }
+
+    return (s2 << 16) | s1;
+}
+
+static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+    /*
+     * Checksum of the concatenation of two buffers, given each one's
+     * checksum and the length of the second (as in zlib's adler32_combine).
+     */
+
+    uint32_t rem = len2 % kAdlerBase;
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = uint64_t(rem) * sum1 % kAdlerBase;
+
+    sum1 += (adler2 & 0xffff) + kAdlerBase - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + kAdlerBase - rem;
+    if (sum1 >= kAdlerBase) sum1 -= kAdlerBase;
+    if (sum1 >= kAdlerBase) sum1 -= kAdlerBase;
+    if (sum2 >= (kAdlerBase << 1)) sum2 -= (kAdlerBase << 1);
+    if (sum2 >= kAdlerBase) sum2 -= kAdlerBase;
+
+    return (sum2 << 16) | sum1;
+}
+
+static void append32(std::vector<unsigned char> &v, uint32_t value)
+{
+    v.push_back(value >> 24);
+    v.push_back(value >> 16);
+    v.push_back(value >> 8);
+    v.push_back(value);
+}
+
+static unsigned appendChunk(std::vector<unsigned char> &out, const char *type,
+    const std::vector<unsigned char> &data)
+{
+    unsigned char *buffer = 0;
+    size_t size = 0;
+
+    unsigned error = lodepng_chunk_create(&buffer, &size, data.size(), type,
+        data.empty() ? 0 : &data[0]);
+    if (!error)
+        out.insert(out.end(), buffer, buffer + size);
+
+    free(buffer);
+    return error;
+}
+
+unsigned encodePng(std::vector<unsigned char> &out, const std::vector<unsigned char> &rgb,
+    unsigned width, unsigned height, unsigned threads)
+{
+    struct Piece {
+        unsigned top, bottom;
+        unsigned char *deflated;
+        size_t deflatedSize;
+        uint32_t adler;
+        unsigned error;
+    };
+
+    const size_t bpp = 3;
+    const size_t lineBytes = width * bpp;
+    const size_t filteredLine = lineBytes + 1;
+
+    if (!width || !height || rgb.size() < lineBytes * height)
+        return 84;
+
+    std::vector<unsigned char> filtered(filteredLine * height);
+
+    unsigned numPieces = std::max<size_t>(1, filtered.size() / kPieceBytes);
+    numPieces = std::min(numPieces, height);
+
+    std::vector<Piece> pieces(numPieces);
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> nextPiece(0);
+    LodePNGCompressSettings settings = lodepng_default_compress_settings;
+
+    for (unsigned i = 0; i < numPieces; ++i) {
+        Piece &p = pieces[i];
+        p.top = uint64_t(height) * i / numPieces;
+        p.bottom = uint64_t(height) * (i + 1) / numPieces;
+        p.deflated = 0;
+        p.deflatedSize = 0;
+    }
+
+    auto worker = [&] {
+        std::vector<unsigned char> scratch(lineBytes);
+
+        for (unsigned i; (i = nextPiece.fetch_add(1)) < numPieces;) {
+            Piece &p = pieces[i];
+            bool last = i == numPieces - 1;
+
+            for (unsigned y = p.top; y < p.bottom; ++y)
+                filterRow(&filtered[y * filteredLine], &rgb[y * lineBytes],
+                    y ? &rgb[(y - 1) * lineBytes] : 0, lineBytes, bpp, &scratch[0]);
+
+            const unsigned char *begin = &filtered[p.top * filteredLine];
+            size_t size = (p.bottom - p.top) * filteredLine;
+
+            p.adler = adler32(begin, size);
+            p.error = lodepng_deflate_part(&p.deflated, &p.deflatedSize, begin, size, &settings, last);
+        }
+    };
+
+    threads = std::max(1u, std::min(threads, numPieces));
+    for (unsigned i = 1; i < threads; ++i)
+        workers.push_back(std::thread(worker));
+    worker();
+
+    for (unsigned i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    /*
+     * zlib stream: CMF 0x78 (deflate, 32K window), FLG 0x01 (fastest, no
+     * dictionary, check bits), the deflate parts, then the Adler-32.
+     */
+
+    unsigned error = 0;
+    std::vector<unsigned char> zlib;
+    uint32_t adler = 1;
+
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+
+    for (unsigned i = 0; i < numPieces; ++i) {
+        Piece &p = pieces[i];
+        if (p.error && !error)
+            error = p.error;
+        zlib.insert(zlib.end(), p.deflated, p.deflated + p.deflatedSize);
+        adler = adler32Combine(adler, p.adler, (p.bottom - p.top) * filteredLine);
+        free(p.deflated);
+    }
+
+    if (error)
+        return error;
+
+    append32(zlib, adler);
+
+    std::vector<unsigned char> header;
+    append32(header, width);
+    append32(header, height);
+    header.push_back(8);        // Bit depth
+    header.push_back(2);        // Color type: truecolor
+    header.push_back(0);        // Compression method
+    header.push_back(0);        // Filter method
+    header.push_back(0);        // No interlacing
+
+    static const unsigned char signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    out.assign(signature, signature + sizeof signature);
+
+    if (!error) error = appendChunk(out, "IHDR", header);
+    if (!error) error = appendChunk(out, "IDAT", zlib);
+    if (!error) error = appendChunk(out, "IEND", std::vector<unsigned char>());
+    return error;
+}
@@ -1567,6 +1567,10 @@ void Color::testSpectrum(double temperature)
 
 void Color::setWavelength(double nm)
 {
+#ifdef HQZ_RGBX_HISTOGRAM
+    pad = 0;
+#endif
+
     if (nm == 0) {
         // Monochromatic white
         r = g = b = 8192;
@@ -29,21 +29,53 @@
 #include <stdint.h>
 #include <math.h>
 
+#if defined(HQZ_RGBX_HISTOGRAM) && defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 
 struct Color
 {
+    /*
+     * With -DHQZ_RGBX_HISTOGRAM, colors and histogram pixels are padded to
+     * four lanes, with zero in the last one. A plot is then a single vector
+     * multiply and add, if we have AVX2.
+     */
+
+#ifdef HQZ_RGBX_HISTOGRAM
+    int r, g, b, pad;
+#else
     int r, g, b;
+#endif
 
     void setWavelength(double nm);
 
     static double blackbodyWavelength(double temperature, double uniform);
     static void testSpectrum(double temperature);
 
-    void __attribute__((always_inline)) plot(int64_t *ptr, int intensity)
+    void __attribute__((always_inline)) plot(int64_t *ptr, int intensity) const
     {
+#if defined(HQZ_RGBX_HISTOGRAM) && defined(__AVX2__)
+        // Same 32-bit products as below, sign extended and added in one go
+        __m128i products = _mm_mullo_epi32(_mm_loadu_si128((const __m128i*) &r),
+            _mm_set1_epi32(intensity));
+        __m256i *pixel = (__m256i*) ptr;
+        _mm256_store_si256(pixel, _mm256_add_epi64(_mm256_load_si256(pixel),
+            _mm256_cvtepi32_epi64(products)));
+#else
         ptr[0] += r * intensity;
         ptr[1] += g * intensity;
         ptr[2] += b * intensity;
+#endif
+    }
+
+    // Same as plot(), but safe when other threads plot to the same pixel.
+    // Ordering doesn't matter to us, only that no adds are lost.
+    void __attribute__((always_inline)) plotAtomic(int64_t *ptr, int intensity) const
+    {
+        __atomic_fetch_add(&ptr[0], int64_t(r * intensity), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ptr[1], int64_t(g * intensity), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ptr[2], int64_t(b * intensity), __ATOMIC_RELAXED);
     }
 
     bool isVisible()
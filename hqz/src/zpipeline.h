@@ -0,0 +1,246 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "histogramimage.h"
+#include "spectrum.h"
+
+
+/*
+ * One line segment to be drawn into the histogram, in image coordinates.
+ */
+
+struct ZSegment {
+    Color color;
+    double x0, y0, x1, y1;
+};
+
+
+/**
+ * A thread's buffer of segments, drawn all at once in order of the screen
+ * tile each one starts in. Consecutive lines then tend to land in the same
+ * part of the histogram while it's still in cache. Every segment is still
+ * drawn whole and exactly once, and the histogram is a sum of integers, so
+ * the image is identical to drawing each segment as it's traced.
+ */
+
+class SegmentBatch {
+public:
+    size_t size() const { return mSegments.size(); }
+    void push(const ZSegment &s) { mSegments.push_back(s); }
+    void flush(HistogramImage &image);
+
+private:
+    static const unsigned kTileBits = 6;    // 64x64 pixel tiles
+
+    std::vector<ZSegment> mSegments;
+    std::vector<uint64_t> mOrder;           // Tile in the high half, segment in the low half
+
+    static unsigned tile(double v, unsigned limit) {
+        // Clamp to the image. Written so that NaN clamps too.
+        double c = v < 0.0 ? 0.0 : v < limit ? v : limit;
+        return unsigned(c) >> kTileBits;
+    }
+};
+
+
+/**
+ * Single-producer single-consumer ring buffer of segments.
+ *
+ * The head is only written by the producer and the tail by the consumer,
+ * each on its own cache line. Each side keeps a cached copy of the other's
+ * index so it only touches the shared line when the ring looks full/empty.
+ */
+
+class SegmentRing {
+public:
+    static const unsigned kCapacity = 1024;     // Must be a power of two
+
+    SegmentRing() : mHead(0), mTail(0), mCachedTail(0), mCachedHead(0) {}
+
+    bool push(const ZSegment &s)
+    {
+        unsigned head = mHead.load(std::memory_order_relaxed);
+        if (head - mCachedTail == kCapacity) {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if (head - mCachedTail == kCapacity)
+                return false;
+        }
+        mItems[head & (kCapacity - 1)] = s;
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(ZSegment &s)
+    {
+        unsigned tail = mTail.load(std::memory_order_relaxed);
+        if (tail == mCachedHead) {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if (tail == mCachedHead)
+                return false;
+        }
+        s = mItems[tail & (kCapacity - 1)];
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    alignas(64) std::atomic<unsigned> mHead;
+    alignas(64) std::atomic<unsigned> mTail;
+    alignas(64) unsigned mCachedTail;       // Producer's view
+    alignas(64) unsigned mCachedHead;       // Consumer's view
+    ZSegment mItems[kCapacity];
+};
+
+
+/**
+ * Pipeline connecting tracer threads to rasterizer threads.
+ *
+ * The image is split into horizontal bands, one per rasterizer. Each
+ * rasterizer owns its band exclusively, so it can plot without atomics
+ * and its part of the histogram stays in its own cache. Tracers route
+ * each segment to every band it might touch, through a private ring for
+ * each (tracer, rasterizer) pair. A rasterizer draws only the part of a
+ * segment inside its band, so the bands sum to exactly the same image
+ * as drawing each segment once.
+ */
+
+class ZPipeline {
+public:
+    ZPipeline(unsigned tracers, unsigned rasterizers, unsigned height)
+        : mTracers(tracers), mRasterizers(rasterizers),
+          mRings(tracers * rasterizers), mFinished(0)
+    {
+        for (unsigned i = 0; i <= rasterizers; ++i)
+            mBands.push_back(uint64_t(height) * i / rasterizers);
+    }
+
+    unsigned numRasterizers() const { return mRasterizers; }
+
+    // Send a segment from a tracer to every band it overlaps.
+    void emit(unsigned tracer, const ZSegment &s);
+
+    // A tracer is done emitting segments.
+    void finish() { mFinished.fetch_add(1, std::memory_order_release); }
+
+    // Rasterizer main loop. Returns once all tracers have finished and
+    // everything they sent to this band has been drawn.
+    void rasterize(unsigned rasterizer, HistogramImage &image);
+
+private:
+    unsigned mTracers, mRasterizers;
+    std::vector<unsigned> mBands;           // Band i is rows [mBands[i], mBands[i+1])
+    std::vector<SegmentRing> mRings;        // Indexed by tracer * mRasterizers + rasterizer
+    std::atomic<unsigned> mFinished;
+
+    SegmentRing &ring(unsigned tracer, unsigned rasterizer) {
+        return mRings[tracer * mRasterizers + rasterizer];
+    }
+};
+
+
+inline void SegmentBatch::flush(HistogramImage &image)
+{
+    unsigned tilesX = (image.width() >> kTileBits) + 1;
+
+    mOrder.resize(mSegments.size());
+    for (size_t i = 0; i < mSegments.size(); ++i) {
+        const ZSegment &s = mSegments[i];
+        uint64_t t = tile(s.y0, image.height()) * tilesX + tile(s.x0, image.width());
+        mOrder[i] = (t << 32) | i;
+    }
+
+    std::sort(mOrder.begin(), mOrder.end());
+
+    for (size_t i = 0; i < mOrder.size(); ++i) {
+        const ZSegment &s = mSegments[uint32_t(mOrder[i])];
+        image.line(s.color, s.x0, s.y0, s.x1, s.y1);
+    }
+
+    mSegments.clear();
+}
+
+inline void ZPipeline::emit(unsigned tracer, const ZSegment &s)
+{
+    /*
+     * Wu's algorithm rounds endpoints to the nearest pixel center, which can
+     * move them by half a pixel in either axis, and it touches one extra row
+     * below each sample. So it draws within rows floor(min y - 0.5) through
+     * floor(max y + 0.5) + 1. Clipping only shrinks this. We use a slightly
+     * more generous estimate. Segments with NaN coordinates are never drawn,
+     * so we can drop them here.
+     */
+
+    double top = std::min(s.y0, s.y1) - 1.0;
+    double bottom = std::max(s.y0, s.y1) + 2.0;
+    if (!(top <= bottom))
+        return;
+    if (bottom < 0.0 || top >= mBands.back())
+        return;
+
+    for (unsigned r = 0; r < mRasterizers; ++r) {
+        if (bottom < mBands[r] || top >= mBands[r + 1])
+            continue;
+
+        SegmentRing &q = ring(tracer, r);
+        while (!q.push(s))
+            std::this_thread::yield();
+    }
+}
+
+inline void ZPipeline::rasterize(unsigned rasterizer, HistogramImage &image)
+{
+    unsigned top = mBands[rasterizer];
+    unsigned bottom = mBands[rasterizer + 1];
+
+    for (;;) {
+        // Read this before draining, so we can't miss a tracer's last segments.
+        bool done = mFinished.load(std::memory_order_acquire) == mTracers;
+        bool idle = true;
+        ZSegment s;
+
+        for (unsigned t = 0; t < mTracers; ++t) {
+            SegmentRing &q = ring(t, rasterizer);
+            while (q.pop(s)) {
+                image.line(s.color, s.x0, s.y0, s.x1, s.y1, top, bottom);
+                idle = false;
+            }
+        }
+
+        if (idle) {
+            if (done)
+                return;
+            std::this_thread::yield();
+        }
+    }
+}
@@ -31,6 +31,7 @@
 #include "zobject.h"
 #include <stdio.h>
 #include <cfloat>
+#include <thread>
 #include <vector>
 
 
@@ -39,7 +40,9 @@ public:
     typedef uint32_t Index;
     typedef std::vector<Index> IndexArray;
 
-    void build(const std::vector<ZObject> &objects);
+    // Build the tree, using up to 'threads' threads. The result doesn't
+    // depend on the thread count.
+    void build(const std::vector<ZObject> &objects, unsigned threads = 1);
     bool rayIntersect(IntersectionData &d, Sampler &s);
 
     struct Visitor;
@@ -61,11 +64,15 @@ private:
         Node *children[2];      // [ < split, >= split ]
     };
 
+    // Only build both children of a node concurrently when each has at
+    // least this many objects. Smaller subtrees aren't worth a thread.
+    static const unsigned kParallelThreshold = 4096;
+
     Node mRoot;
     const std::vector<ZObject> *mObjects;
 
     bool rayIntersect(IntersectionData &d, Sampler &s, Visitor &v);
-    void split(Visitor &v);
+    void split(Visitor &v, unsigned threads);
     double splitPosition(Visitor &v);
 };
 
@@ -124,7 +131,7 @@ struct ZQuadtree::Visitor
 };
 
 
-inline void ZQuadtree::build(const std::vector<ZObject> &objects)
+inline void ZQuadtree::build(const std::vector<ZObject> &objects, unsigned threads)
 {
     /*
      * Start out with all items in the root node
@@ -140,10 +147,10 @@ inline void ZQuadtree::build(const std::vector<ZObject> &objects)
      */
 
     Visitor v = Visitor::root(this);
-    split(v);
+    split(v, threads);
 }
 
-inline void ZQuadtree::split(Visitor &v)
+inline void ZQuadtree::split(Visitor &v, unsigned threads)
 {
     Node &node = *v.current;
 
@@ -194,9 +201,25 @@ inline void ZQuadtree::split(Visitor &v)
 
     node.objects.resize(out);
 
-    // Recursively split child nodes    
-    split(first);
-    split(second);
+    /*
+     * Recursively split child nodes. The two subtrees share nothing, so when
+     * both are large we build them concurrently, dividing our threads
+     * between them. Each subtree comes out exactly as the serial build.
+     */
+
+    if (threads > 1 &&
+        first.current->objects.size() >= kParallelThreshold &&
+        second.current->objects.size() >= kParallelThreshold) {
+
+        unsigned firstThreads = threads / 2;
+        std::thread t([this, &first, firstThreads] { split(first, firstThreads); });
+        split(second, threads - firstThreads);
+        t.join();
+
+    } else {
+        split(first, threads);
+        split(second, threads);
+    }
 }
 
 inline double ZQuadtree::splitPosition(Visitor &v)
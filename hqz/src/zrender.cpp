@@ -25,52 +25,89 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <errno.h>
 #include <float.h>
-#include <time.h>
+#include <string.h>
+#include <unistd.h>
 #include <thread>
 #include "zrender.h"
 #include "zmaterial.h"
 
 #include <stdio.h>
 
-ZRender::ZRender(ZScene scene, int seed, int rays)
+ZRender::ZRender(ZScene &scene, uint32_t seed, uint32_t rays)
     : mScene(scene),
-    mLightPower(0.0),
-    mBatches(),
-    mBatchesMutex()
+    mLightPower(scene.lightPower),
+    mThreads(1),
+    mMemoryBudget(defaultMemoryBudget()),
+    mNuma(false),
+    mRasterizers(0),
+    mBatchSize(0),
+    mDither(),
+    mCheckpointInterval(0),
+    mSecondsTraced(0),
+    mResumed(false),
+    mEpoch(0),
+    mStop(false)
 {
     // Optional iteger values
-    mSeed = seed; //checkInteger(mScene["seed"], "seed");
+    mSeed = seed;
     mDebug = mScene.debug;
 
-    // Integer resolution values
-    mImage.resize(mScene.r_width, mScene.r_height);
+    // Integer resolution values. White light only needs one channel.
+    bool mono = !mDebug && isWhiteLight();
+    mImage.resize(mScene.r_width, mScene.r_height, mono);
+    if (mono)
+        fprintf(stderr, "All lights are white, using a monochrome histogram\n");
 
     // Check stopping conditions
-    mRayLimit = rays; //checkNumber(mScene["rays"], "rays");
+    mRayLimit = rays;
+    mRaysTraced = 0;
     mTimeLimit = mScene.timelimit;
     if (mRayLimit <= 0.0 && mTimeLimit <= 0.0) {
         mError << "No stopping conditions set. Expected a ray limit and/or time limit.\n";
     }
 
-    printf("seed: %i, raycount: %d\n", mSeed, mRayLimit);
+    fprintf(stderr, "seed: %u, raycount: %u\n", mSeed, mRayLimit);
 }
 
-void ZRender::static_render(ZRender *zr)
+bool ZRender::isWhiteLight() const
 {
-    std::vector<unsigned char> pixels;
-    return zr->render(pixels);
+    // True if every ray's color comes from setWavelength(0), which is white.
+
+    for (unsigned i = 0; i < mScene.lights.size(); ++i) {
+        Sampler::Bounds b = Sampler::bounds(mScene.lights[i].wavelength);
+        if (b.min != 0 || b.max != 0)
+            return false;
+    }
+    return true;
+}
+
+uint64_t ZRender::defaultMemoryBudget()
+{
+    // By default, let histograms use up to half of the memory we may use:
+    // physical memory, or our cgroup's limit if that's smaller.
+
+    uint64_t total = ZTopology::cgroupMemoryLimit();
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGE_SIZE);
+    if (pages > 0 && pageSize > 0 && (!total || uint64_t(pages) * pageSize < total))
+        total = uint64_t(pages) * pageSize;
+
+    if (!total)
+        return UINT64_MAX;
+    return total / 2;
 }
 
 void ZRender::render(std::vector<unsigned char> &pixels)
 {
-    mQuadtree.build(mScene.objects);
+    mQuadtree.build(mScene.objects, mThreads);
 
     /*
      * Debug flags
      */
 
-    if (mDebug & kDebugQuadtree) {
+    if ((mDebug & kDebugQuadtree) && !mResumed) {
         ZQuadtree::Visitor v = ZQuadtree::Visitor::root(&mQuadtree);
         renderDebugQuadtree(v);
     }
@@ -89,27 +126,34 @@ void ZRender::render(std::vector<unsigned char> &pixels)
     if (gamma <= 0.0)
         gamma = 1.0;
 
-    /* 
-     * Exposure calculation as a backward-compatible generalization of zenphoton.com.
-     * We need to correct for differences due to resolution and due to the higher
-     * fixed-point resolution we use during histogram rendering.
-     */
-
-    double exposure = mScene.exposure;
-    double areaScale = sqrt(double(width()) * height() / (1024 * 576));
-    double intensityScale = mLightPower / (255.0 * 8192.0);
-    double scale = exp(1.0 + 10.0 * exposure) * areaScale * intensityScale / numRays;
+    double scale = mImage.exposureScale(mScene.exposure, mLightPower, numRays);
+    mImage.render(pixels, scale, 1.0 / gamma, mThreads, mDither);
+}
 
-    mImage.render(pixels, scale, 1.0 / gamma);
+HistogramHeader ZRender::histogramHeader() const
+{
+    HistogramHeader h;
+    h.width = width();
+    h.height = height();
+    h.channels = mImage.channels();
+    h.seedStart = mSeed;
+    h.seedCount = mRayLimit;
+    h.rays = mRaysTraced;
+    h.sceneHash = mScene.hash;
+    h.lightPower = mLightPower;
+    h.exposure = mScene.exposure;
+    h.gamma = mScene.gamma;
+    h.seconds = mSecondsTraced;
+    return h;
 }
 
-ZLight &ZRender::chooseLight(Sampler &s)
+const ZLight &ZRender::chooseLight(const ZScene &scene, Sampler &s)
 {
     // Pick a random light, using the light power as a probability weight.
     // Fast path for scenes with only one light.
 
     unsigned i = 0;
-    unsigned last = mScene.lights.size() - 1;
+    unsigned last = scene.lights.size() - 1;
 
     if (i != last) {
         double r = s.uniform(0, mLightPower);
@@ -117,7 +161,7 @@ ZLight &ZRender::chooseLight(Sampler &s)
 
         // Check all lights except the last
         do {
-            ZLight &light = mScene.lights[i++];
+            const ZLight &light = scene.lights[i++];
             sum += s.value(light.power);
             if (r <= sum)
                 return light;
@@ -125,7 +169,7 @@ ZLight &ZRender::chooseLight(Sampler &s)
     }
 
     // Default, last light.
-    ZLight &l = mScene.lights[last];
+    const ZLight &l = scene.lights[last];
     return l;
 }
 
@@ -133,66 +177,448 @@ void ZRender::interrupt()
 {
     /*
      * Interrupt traceRays() in progress. The render will return as
-     * soon as the next batch of rays finishes and the histogram is rendered.
+     * soon as the current batches of rays finish and the histogram is rendered.
+     * Called from a signal handler, so this must not take any locks.
      */
 
-    mRayLimit = -1;
-    while(!mBatches.empty()) {
-        mBatches.pop_back();
-    }
+    mStop.store(true, std::memory_order_relaxed);
 }
 
 uint64_t ZRender::traceRays()
 {
     /*
-     * Keep tracing rays until a stopping condition is hit.
-     * Returns the total number of rays traced.
+     * Keep tracing rays until a stopping condition is hit. Returns the total
+     * number of rays traced, including any from a checkpoint we resumed.
+     *
+     * With checkpoints, the range is traced in epochs of about one checkpoint
+     * interval each. An epoch traces every seed in its range unless it's
+     * stopped early, so after each complete epoch the histogram holds exactly
+     * the seeds [mSeed, mSeed + mRaysTraced). That's all a checkpoint needs
+     * to record for a resumed render to finish with the same image as one
+     * uninterrupted run.
      */
 
-    uint64_t rayCount = 0;
-    uint32_t seed = mSeed;
-    double startTime = (double)time(0);
+    static const uint64_t kMinEpoch = 1 << 12;
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    Clock::time_point due = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(mCheckpointInterval));
+    double secondsBefore = mSecondsTraced;
+
+    mDeadline = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(mTimeLimit - secondsBefore));
+
+    uint64_t epoch = mCheckpointPath.empty() ? 0 : kMinEpoch;
+
+    for (mEpoch = 0;; ++mEpoch) {
+        // Zero means unbounded, for both of these
+        uint64_t remaining = mRayLimit ? mRayLimit - mRaysTraced : 0;
+        uint64_t count = epoch && (!remaining || epoch < remaining) ? epoch : remaining;
+        if (mRayLimit && !remaining)
+            break;
+
+        Clock::time_point epochStart = Clock::now();
+        uint64_t traced = traceRange(mSeed + uint32_t(mRaysTraced), count);
+        Clock::time_point now = Clock::now();
 
-    //mBatches.reserve(mRayLimit / batch);
+        mRaysTraced += traced;
+        mSecondsTraced = secondsBefore + std::chrono::duration<double>(now - start).count();
 
-    while (1) {
-        // Minimum frequency for checking stopping conditions
-        int batch = 1000;
+        if (!count || traced < count)
+            break;
 
-        if (mRayLimit) {
-            // Set batch size according to remaining rays.
-            batch = std::min<double>(batch, mRayLimit - rayCount);
-            if (batch <= 0)
-                break;
+        if (now >= due) {
+            if (!mRayLimit || mRaysTraced < mRayLimit)
+                writeCheckpoint();
+            due = now + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(mCheckpointInterval));
         }
 
-        if (mTimeLimit) {
-            // Check time limit
-            double now = (double)time(0);
-            if (now > startTime + mTimeLimit)
-                break;
+        if (mStop.load(std::memory_order_relaxed))
+            break;
+
+        // Size the next epoch to end when the next checkpoint is due, at the rate we've seen
+        double seconds = std::max(1e-3, std::chrono::duration<double>(now - epochStart).count());
+        double untilDue = std::chrono::duration<double>(due - now).count();
+        epoch = std::max<double>(kMinEpoch, traced / seconds * untilDue);
+    }
+
+    return mRaysTraced;
+}
+
+void ZRender::writeCheckpoint()
+{
+    // Written atomically, so a crash during the write leaves the last checkpoint intact.
+
+    HistogramHeader h = histogramHeader();
+    h.checkpoint = 1;
+
+    if (!saveHistogram(mCheckpointPath.c_str(), h, mImage)) {
+        fprintf(stderr, "Error writing checkpoint %s: %s\n", mCheckpointPath.c_str(), strerror(errno));
+        return;
+    }
+
+    fprintf(stderr, "Checkpoint: %llu rays in %.1f seconds\n",
+        (unsigned long long) mRaysTraced, mSecondsTraced);
+}
+
+bool ZRender::resume(const char *path)
+{
+    HistogramFile file;
+    if (!file.open(path)) {
+        mError << file.errorText() << "\n";
+        return false;
+    }
+
+    const HistogramHeader &h = file.header();
+    if (!h.checkpoint) {
+        mError << path << ": not a checkpoint\n";
+    } else if (h.sceneHash != mScene.hash) {
+        mError << path << ": checkpoint is from a different scene\n";
+    } else if (h.seedStart != mSeed || h.seedCount != mRayLimit) {
+        mError << path << ": checkpoint is for a different range of seeds\n";
+    } else if (!file.addTo(mImage)) {
+        mError << path << ": checkpoint has a different image size\n";
+    } else {
+        mRaysTraced = h.rays;
+        mSecondsTraced = h.seconds;
+        mResumed = true;
+        fprintf(stderr, "Resuming from %s: %llu rays in %.1f seconds\n",
+            path, (unsigned long long) mRaysTraced, mSecondsTraced);
+        return true;
+    }
+
+    return false;
+}
+
+uint64_t ZRender::traceRange(uint32_t firstSeed, uint64_t count)
+{
+    /*
+     * Trace the seeds [firstSeed, firstSeed + count), or until a stopping
+     * condition is hit if count is zero. Returns the number of rays traced.
+     *
+     * Each worker thread traces into its own histogram shard. The first
+     * worker uses mImage directly, the rest get private copies which are
+     * summed back into mImage afterwards. Every ray is seeded independently
+     * and integer addition is order-independent, so the result is
+     * bit-identical regardless of the number of threads.
+     *
+     * If a shard per thread won't fit in our memory budget, all workers
+     * share mImage instead and plot into it with atomic adds. This is
+     * slower per plot, but the result is the same.
+     */
+
+    mScheduler.reset(mThreads, firstSeed, count);
+
+    if (mRasterizers)
+        return traceRaysPipelined();
+
+    if (mNuma && mThreads > 1) {
+        ZTopology topology = ZTopology::detect();
+        if (topology.nodes.size() > 1)
+            return traceRaysNuma(topology);
+        if (!mEpoch)
+            fprintf(stderr, "Only one NUMA node available, ignoring NUMA mode\n");
+    }
+
+    uint64_t shardBytes = HistogramImage::bytesFor(width(), height(), mImage.mono());
+    bool shared = mThreads > 1 && shardBytes * mThreads > mMemoryBudget;
+
+    if (mThreads > 1 && !mEpoch) {
+        fprintf(stderr, "Accumulating into %s (%.1f MB)\n",
+            shared ? "one shared atomic histogram" : "a private histogram per thread",
+            (shared ? shardBytes : shardBytes * mThreads) / 1e6);
+    }
+
+    std::vector<HistogramImage> shards(shared ? 0 : mThreads - 1);
+    std::vector<Worker> workers(mThreads);
+    std::vector<std::thread> threads;
+
+    mImage.setAtomic(shared);
+
+    for (unsigned i = 0; i < mThreads; ++i) {
+        Worker &w = workers[i];
+        w.index = i;
+        w.scene = &mScene;
+        w.quadtree = &mQuadtree;
+        w.image = &mImage;
+        w.pipeline = 0;
+
+        if (i && !shared) {
+            w.image = &shards[i - 1];
+            w.image->resize(width(), height(), mImage.mono());
         }
 
-        traceRayBatch(seed, batch);
+        if (i)
+            threads.push_back(std::thread(&ZRender::worker, this, &w));
+    }
+
+    worker(&workers[0]);
 
-        seed += batch;
-        rayCount += batch;            
+    for (unsigned i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    mImage.setAtomic(false);
+
+    std::vector<const HistogramImage*> sources;
+    for (unsigned i = 0; i < shards.size(); ++i)
+        sources.push_back(&shards[i]);
+    reduce(mImage, sources, mThreads, 0);
+
+    uint64_t total = 0;
+    for (unsigned i = 0; i < workers.size(); ++i)
+        total += workers[i].rayCount;
+    return total;
+}
+
+uint64_t ZRender::traceRaysPipelined()
+{
+    /*
+     * Pipelined variant of traceRange(). Tracer threads only intersect rays
+     * with the scene, and hand each segment to the rasterizer threads through
+     * ring buffers. Each rasterizer owns a horizontal band of mImage.
+     * Tracers never touch the histogram, so the quadtree and scene data stay
+     * hot in their caches, and no two threads ever plot to the same pixel.
+     */
+
+    if (!mEpoch)
+        fprintf(stderr, "Pipelined rendering with %u tracer and %u rasterizer threads\n",
+            mThreads, mRasterizers);
+
+    ZPipeline pipeline(mThreads, mRasterizers, height());
+    std::vector<Worker> workers(mThreads);
+    std::vector<std::thread> threads;
+
+    for (unsigned r = 0; r < mRasterizers; ++r)
+        threads.push_back(std::thread(&ZPipeline::rasterize, &pipeline, r, std::ref(mImage)));
+
+    for (unsigned i = 0; i < mThreads; ++i) {
+        Worker &w = workers[i];
+        w.index = i;
+        w.scene = &mScene;
+        w.quadtree = &mQuadtree;
+        w.image = 0;
+        w.pipeline = &pipeline;
+
+        threads.push_back(std::thread([this, &w, &pipeline] {
+            worker(&w);
+            pipeline.finish();
+        }));
     }
 
-    return rayCount;
+    for (unsigned i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    uint64_t total = 0;
+    for (unsigned i = 0; i < workers.size(); ++i)
+        total += workers[i].rayCount;
+    return total;
 }
 
-void ZRender::worker(ZRender *zr) {
-    while (!zr->mBatches.empty()) {
-        zr->mBatchesMutex.lock();
-        Batch b = zr->mBatches.back();
-        zr->mBatches.pop_back();
-        zr->mBatchesMutex.unlock();
-        zr->traceRayBatch(b.seed, b.size);
+uint64_t ZRender::traceRaysNuma(const ZTopology &topology)
+{
+    /*
+     * NUMA-aware variant of traceRange(). Threads are spread across nodes in
+     * proportion to each node's CPU count, and pinned there. The first thread
+     * to start on each node builds that node's copy of the scene (lights,
+     * materials and objects) and quadtree, and allocates the node's
+     * histogram, so all of these are first-touched in the node's local
+     * memory. Per-thread shards are also allocated by the thread that uses
+     * them.
+     *
+     * Reduction is hierarchical: threads on each node sum their shards into
+     * the node histogram without leaving the node, and then only one
+     * histogram per node crosses the interconnect on its way into mImage.
+     *
+     * Every histogram counts against the memory budget, mImage included.
+     * When shards don't fit, each node's threads share the node histogram
+     * using atomic adds. When even one histogram per node doesn't fit, all
+     * threads share mImage, and only the scene data stays node-local.
+     */
+
+    unsigned numNodes = std::min<unsigned>(topology.nodes.size(), mThreads);
+    unsigned totalCpus = 0;
+    for (unsigned n = 0; n < numNodes; ++n)
+        totalCpus += topology.nodes[n].cpus.size();
+
+    uint64_t shardBytes = HistogramImage::bytesFor(width(), height(), mImage.mono());
+    uint64_t histograms = mThreads + 1;
+    if (histograms * shardBytes > mMemoryBudget)
+        histograms = numNodes + 1;
+    if (histograms * shardBytes > mMemoryBudget)
+        histograms = 1;
+
+    bool shared = histograms != mThreads + 1;
+    bool perNode = histograms != 1;
+
+    std::vector<NumaNode> nodes(numNodes);
+    std::vector<Worker> workers(mThreads);
+
+    // Proportional thread assignment, with at least one thread per node.
+    unsigned assigned = 0;
+    for (unsigned n = 0; n < numNodes; ++n) {
+        NumaNode &node = nodes[n];
+        node.topology = &topology.nodes[n];
+
+        unsigned remainingNodes = numNodes - n - 1;
+        unsigned count = uint64_t(mThreads) * node.topology->cpus.size() / totalCpus;
+        count = std::max(1u, std::min(count, mThreads - assigned - remainingNodes));
+        if (!remainingNodes)
+            count = mThreads - assigned;
+
+        node.firstWorker = assigned;
+        node.numWorkers = count;
+        node.target = perNode ? &node.image : &mImage;
+        node.shards.resize(shared ? 0 : count - 1);
+        assigned += count;
+
+        if (!mEpoch)
+            fprintf(stderr, "NUMA node %u: %u threads on %u CPUs\n",
+                node.topology->id, count, (unsigned)node.topology->cpus.size());
+    }
+
+    if (!mEpoch)
+        fprintf(stderr, "Accumulating into %s (%.1f MB)\n",
+            !shared ? "a private histogram per thread" :
+            perNode ? "one shared atomic histogram per NUMA node" : "one shared atomic histogram",
+            histograms * shardBytes / 1e6);
+
+    mImage.setAtomic(!perNode);
+
+    std::vector<std::thread> threads;
+    for (unsigned n = 0; n < numNodes; ++n) {
+        for (unsigned j = 0; j < nodes[n].numWorkers; ++j) {
+            Worker &w = workers[nodes[n].firstWorker + j];
+            w.index = nodes[n].firstWorker + j;
+            threads.push_back(std::thread(&ZRender::numaWorker, this, &nodes[n], &w, j, shared));
+        }
+    }
+
+    for (unsigned i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    mImage.setAtomic(false);
+
+    // First level: reduce shards into their node's histogram, on that node.
+    threads.clear();
+    for (unsigned n = 0; n < numNodes; ++n) {
+        NumaNode &node = nodes[n];
+        node.image.setAtomic(false);
+
+        threads.push_back(std::thread([this, &node] {
+            ZTopology::pinCurrentThread(node.topology->cpus);
+            std::vector<const HistogramImage*> sources;
+            for (unsigned i = 0; i < node.shards.size(); ++i)
+                sources.push_back(&node.shards[i]);
+            reduce(node.image, sources, node.numWorkers, &node.topology->cpus);
+        }));
     }
+
+    for (unsigned i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    // Second level: reduce node histograms into mImage, unless they plotted there directly.
+    std::vector<const HistogramImage*> sources;
+    for (unsigned n = 0; n < numNodes && perNode; ++n)
+        sources.push_back(&nodes[n].image);
+    reduce(mImage, sources, mThreads, 0);
+
+    uint64_t total = 0;
+    for (unsigned i = 0; i < workers.size(); ++i)
+        total += workers[i].rayCount;
+    return total;
 }
 
-void ZRender::traceRayBatch(uint32_t seed, uint32_t count)
+void ZRender::numaWorker(NumaNode *node, Worker *w, unsigned localIndex, bool shared)
+{
+    ZTopology::pinCurrentThread(node->topology->cpus);
+
+    std::call_once(node->init, [this, node, shared] {
+        node->scene = mScene;
+        node->quadtree.build(node->scene.objects, node->numWorkers);
+        if (node->target == &node->image) {
+            node->image.resize(width(), height(), mImage.mono());
+            node->image.setAtomic(shared);
+        }
+    });
+
+    w->scene = &node->scene;
+    w->quadtree = &node->quadtree;
+    w->image = node->target;
+    w->pipeline = 0;
+
+    if (localIndex && !shared) {
+        w->image = &node->shards[localIndex - 1];
+        w->image->resize(width(), height(), mImage.mono());
+    }
+
+    worker(w);
+}
+
+void ZRender::reduce(HistogramImage &dest, const std::vector<const HistogramImage*> &sources,
+    unsigned numThreads, const std::vector<unsigned> *cpus)
+{
+    /*
+     * Sum each source histogram into 'dest', splitting the image into
+     * horizontal slices so each thread sums a disjoint set of rows.
+     * Optionally, the threads are pinned to a set of CPUs.
+     */
+
+    if (sources.empty())
+        return;
+
+    std::vector<std::thread> threads;
+    unsigned h = dest.height();
+    unsigned rows = (h + numThreads - 1) / numThreads;
+
+    for (unsigned top = 0; top < h; top += rows) {
+        unsigned bottom = std::min(h, top + rows);
+        threads.push_back(std::thread([&dest, &sources, cpus, top, bottom] {
+            if (cpus)
+                ZTopology::pinCurrentThread(*cpus);
+            for (unsigned i = 0; i < sources.size(); ++i)
+                dest.add(*sources[i], top, bottom);
+        }));
+    }
+
+    for (unsigned i = 0; i < threads.size(); ++i)
+        threads[i].join();
+}
+
+bool ZRender::checkStoppingConditions()
+{
+    /*
+     * Returns true if we should stop tracing. Workers check this between
+     * batches, and batches are sized to take a few milliseconds, so every
+     * thread stops shortly after the stop token is set. The ray limit is
+     * enforced by the scheduler, which simply runs out of work.
+     */
+
+    if (mStop.load(std::memory_order_relaxed))
+        return true;
+
+    if (mTimeLimit > 0 && std::chrono::steady_clock::now() >= mDeadline) {
+        // Let the other workers know without each of them reading the clock
+        mStop.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    return false;
+}
+
+void ZRender::worker(Worker *w)
+{
+    Batch b;
+    w->rayCount = 0;
+
+    while (!checkStoppingConditions() && mScheduler.next(w->index, b)) {
+        traceRayBatch(*w, b.seed, b.size);
+        w->rayCount += b.size;
+    }
+}
+
+void ZRender::traceRayBatch(Worker &w, uint32_t seed, uint32_t count)
 {
     /*
      * Trace a batch of rays, starting with ray number "start", and
@@ -205,11 +631,14 @@ void ZRender::traceRayBatch(uint32_t seed, uint32_t count)
 
     while (count--) {
         Sampler s(seed++);
-        traceRay(s);
+        traceRay(w, s);
     }
+
+    if (w.batch.size())
+        w.batch.flush(*w.image);
 }
 
-void ZRender::traceRay(Sampler &s)
+void ZRender::traceRay(Worker &wk, Sampler &s)
 {
     IntersectionData d;
     d.zobject_id = 0;
@@ -218,39 +647,49 @@ void ZRender::traceRay(Sampler &s)
     double h = height();
 
     // Initialize the ray by sampling a light
-    if (!initRay(s, d.ray, chooseLight(s)))
+    if (!initRay(s, d.ray, chooseLight(*wk.scene, s)))
         return;
 
     // Sample the viewport once per ray. (e.g. for camera motion blur)
     ViewportSample v;
-    initViewport(s, v);
+    initViewport(*wk.scene, s, v);
 
     // Look for a large but bounded number of bounces
     for (unsigned bounces = 1000; bounces; --bounces) {
 
         // Intersect with an object or the edge of the viewport
-        bool hit = rayIntersect(d, s, v);
+        bool hit = rayIntersect(*wk.quadtree, d, s, v);
 
         // Draw a line from d.ray.origin to d.point
-        mImage.line( d.ray.color,
+        ZSegment seg = { d.ray.color,
             v.xScale(d.ray.origin.x, w),
             v.yScale(d.ray.origin.y, h),
             v.xScale(d.point.x, w),
-            v.yScale(d.point.y, h));
+            v.yScale(d.point.y, h) };
+
+        if (wk.pipeline) {
+            wk.pipeline->emit(wk.index, seg);
+        } else if (mBatchSize) {
+            wk.batch.push(seg);
+            if (wk.batch.size() >= mBatchSize)
+                wk.batch.flush(*wk.image);
+        } else {
+            wk.image->line(seg.color, seg.x0, seg.y0, seg.x1, seg.y1);
+        }
 
         if (!hit) {
             // Ray exited the scene after this.
             break;
         }
 
-        if (!rayMaterial(d, s)) {
+        if (!rayMaterial(*wk.scene, d, s)) {
             // Ray was absorbed by material
             break;
         }
     }
 }
 
-bool ZRender::initRay(Sampler &s, Ray &r, ZLight &light)
+bool ZRender::initRay(Sampler &s, Ray &r, const ZLight &light)
 {
     double cartesianX = s.value(light.x);
     double cartesianY = s.value(light.y);
@@ -286,17 +725,17 @@ bool ZRender::initRay(Sampler &s, Ray &r, ZLight &light)
     return true;
 }
 
-void ZRender::initViewport(Sampler &s, ViewportSample &v)
+void ZRender::initViewport(const ZScene &scene, Sampler &s, ViewportSample &v)
 {
     // Sample the viewport. We do this once per ray.
 
-    v.origin.x = s.value(mScene.viewport.x);
-    v.origin.y = s.value(mScene.viewport.y);
-    v.size.x = s.value(mScene.viewport.width);
-    v.size.y = s.value(mScene.viewport.height);
+    v.origin.x = s.value(scene.viewport.x);
+    v.origin.y = s.value(scene.viewport.y);
+    v.size.x = s.value(scene.viewport.width);
+    v.size.y = s.value(scene.viewport.height);
 }
 
-bool ZRender::rayIntersect(IntersectionData &d, Sampler &s, const ViewportSample &v)
+bool ZRender::rayIntersect(ZQuadtree &quadtree, IntersectionData &d, Sampler &s, const ViewportSample &v)
 {
     /*
      * Sample all objects in the scene that d.ray might hit. If we hit an object,
@@ -304,7 +743,7 @@ bool ZRender::rayIntersect(IntersectionData &d, Sampler &s, const ViewportSample
      * edge of the image by rayIntersectBounds() and we return 'false'.
      */
 
-    if (mQuadtree.rayIntersect(d, s)) {
+    if (quadtree.rayIntersect(d, s)) {
         // Quadtree found an intersection
         return true;
     }
@@ -332,7 +771,7 @@ void ZRender::rayIntersectBounds(IntersectionData &d, const ViewportSample &v)
     d.point = d.ray.pointAtDistance(d.ray.intersectFurthestAABB(viewport));
 }
 
-bool ZRender::rayMaterial(IntersectionData &d, Sampler &s)
+bool ZRender::rayMaterial(const ZScene &scene, IntersectionData &d, Sampler &s)
 {
     /*
      * Sample the material indicated by the intersection 'd' and update the ray.
@@ -340,9 +779,9 @@ bool ZRender::rayMaterial(IntersectionData &d, Sampler &s)
      */
 
     // Lookup in our material database
-    ZObject object = mScene.objects[d.zobject_id];
+    ZObject object = scene.objects[d.zobject_id];
     unsigned id = object.material_id;
-    ZMaterial material = mScene.materials[id];
+    ZMaterial material = scene.materials[id];
     return material.rayOutcome(d, s);
 }
 
@@ -354,7 +793,7 @@ void ZRender::renderDebugQuadtree(ZQuadtree::Visitor &v)
 
     ViewportSample vp;
     Sampler s(mSeed);
-    initViewport(s, vp);
+    initViewport(mScene, s, vp);
 
     Color c = { 0x7FFFFFFF, 0x7FFFFFFF, 0 };
     double w = width();
@@ -29,32 +29,51 @@
 #include "rapidjson/document.h"
 #include "prng.h"
 #include "histogramimage.h"
+#include "histogramfile.h"
 #include "ray.h"
 #include "sampler.h"
 #include "zquadtree.h"
 #include "zscene.h"
+#include "zpipeline.h"
+#include "zscheduler.h"
+#include "ztopology.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <sstream>
+#include <string>
 #include <vector>
-#include <mutex>
-
-typedef struct {
-    int seed;
-    int size;
-} Batch;
 
 class ZRender {
 public:
-    ZRender(ZScene scene, int seed, int rays);
+    ZRender(ZScene &scene, uint32_t seed, uint32_t rays);
+
+    void setThreads(unsigned count) { mThreads = std::max(1u, count); }
+    void setMemoryBudget(uint64_t bytes) { mMemoryBudget = bytes; }
+    void setNuma(bool enable) { mNuma = enable; }
+    void setPipeline(unsigned rasterizers) { mRasterizers = rasterizers; }
+    void setBatch(unsigned segments) { mBatchSize = segments; }
+    void setDither(HistogramImage::Dither dither) { mDither = dither; }
+
+    // Save progress to a histogram file about every 'interval' seconds while rendering
+    void setCheckpoint(const char *path, double interval) { mCheckpointPath = path; mCheckpointInterval = interval; }
+
+    // Before render(), continue from a checkpoint of the same scene and seed range.
+    // Returns false, with a message in errorText(), if it doesn't match.
+    bool resume(const char *path);
 
-    static void static_render(ZRender *zr);
     void render(std::vector<unsigned char> &pixels);
     void interrupt();
 
-    const char *errorText() const { return mError.str().c_str(); }
+    std::string errorText() const { return mError.str(); }
     bool hasError() const { return !mError.str().empty(); }
     unsigned width() const { return mImage.width(); }
     unsigned height() const { return mImage.height(); }
 
+    // After render(), the raw counters and a header describing them
+    const HistogramImage &image() const { return mImage; }
+    HistogramHeader histogramHeader() const;
+
 private:
     static const uint32_t kDebugQuadtree = 1 << 0;
 
@@ -67,7 +86,24 @@ private:
     double mLightPower;
     uint32_t mDebug;
     uint32_t mRayLimit;
+    uint64_t mRaysTraced;
     double mTimeLimit;
+    unsigned mThreads;
+    uint64_t mMemoryBudget;
+    bool mNuma;
+    unsigned mRasterizers;
+    unsigned mBatchSize;
+    HistogramImage::Dither mDither;
+    std::string mCheckpointPath;
+    double mCheckpointInterval;
+    double mSecondsTraced;
+    bool mResumed;
+    unsigned mEpoch;        // Setup messages are only printed for the first epoch
+
+    // Set by interrupt() or by the first worker to pass the deadline.
+    // Must be lock-free, since interrupt() is called from a signal handler.
+    std::atomic<bool> mStop;
+    static_assert(ATOMIC_BOOL_LOCK_FREE == 2, "Stop token must be lock-free");
 
     std::ostringstream mError;
 
@@ -84,25 +120,58 @@ private:
         }            
     };
 
-    std::vector<Batch> mBatches;
-    std::mutex mBatchesMutex;
+    ZScheduler mScheduler;
+    std::chrono::steady_clock::time_point mDeadline;
+
+    // Per-thread tracing state
+    struct Worker {
+        unsigned index;
+        const ZScene *scene;    // mScene, or a node-local copy
+        HistogramImage *image;
+        ZQuadtree *quadtree;
+        ZPipeline *pipeline;    // If set, segments go here instead of 'image'
+        SegmentBatch batch;     // Segments waiting to be drawn, if batching
+        uint64_t rayCount;
+    };
+
+    // Per-node state for NUMA mode, allocated by the node's first worker
+    struct NumaNode {
+        const ZTopology::Node *topology;
+        unsigned firstWorker, numWorkers;
+        std::once_flag init;
+        ZScene scene;
+        ZQuadtree quadtree;
+        HistogramImage image;
+        HistogramImage *target;     // 'image', or mImage if every node shares it
+        std::vector<HistogramImage> shards;
+    };
 
     // Raytracer entry point
-    void traceRay(Sampler &s);
-    static void worker(ZRender* zr);
-    void traceRayBatch(uint32_t seed, uint32_t count);
+    void traceRay(Worker &wk, Sampler &s);
+    void worker(Worker *w);
+    void numaWorker(NumaNode *node, Worker *w, unsigned localIndex, bool shared);
+    bool checkStoppingConditions();
+    static uint64_t defaultMemoryBudget();
+    bool isWhiteLight() const;
+    void traceRayBatch(Worker &w, uint32_t seed, uint32_t count);
     uint64_t traceRays();
+    uint64_t traceRange(uint32_t firstSeed, uint64_t count);
+    void writeCheckpoint();
+    uint64_t traceRaysNuma(const ZTopology &topology);
+    uint64_t traceRaysPipelined();
+    static void reduce(HistogramImage &dest, const std::vector<const HistogramImage*> &sources,
+        unsigned numThreads, const std::vector<unsigned> *cpus);
 
     // Light sampling
-    ZLight &chooseLight(Sampler &s);
-    bool initRay(Sampler &s, Ray &r, ZLight &light);
-    void initViewport(Sampler &s, ViewportSample &v);
+    const ZLight &chooseLight(const ZScene &scene, Sampler &s);
+    bool initRay(Sampler &s, Ray &r, const ZLight &light);
+    void initViewport(const ZScene &scene, Sampler &s, ViewportSample &v);
 
     // Material sampling
-    bool rayMaterial(IntersectionData &d, Sampler &s);
+    bool rayMaterial(const ZScene &scene, IntersectionData &d, Sampler &s);
 
     // Object sampling
-    bool rayIntersect(IntersectionData &d, Sampler &s, const ViewportSample &v);
+    bool rayIntersect(ZQuadtree &quadtree, IntersectionData &d, Sampler &s, const ViewportSample &v);
     void rayIntersectBounds(IntersectionData &d, const ViewportSample &v);
 
     // Debugging
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 #include <vector>
 
 #include "zobject.h"
@@ -16,9 +17,10 @@ struct ZScene {
     double gamma;
     int seed;
     long int rays;
-    long int timelimit;
+    double timelimit;
     std::vector<ZMaterial> materials;
     std::vector<ZObject> objects;
     std::vector<ZLight> lights;
     double lightPower;
+    uint64_t hash;      // Identifies the scene's JSON text
 };
\ No newline at end of file
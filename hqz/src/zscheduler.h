@@ -0,0 +1,238 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+
+struct Batch {
+    uint32_t seed;
+    uint32_t size;
+};
+
+
+/**
+ * Work-stealing scheduler for batches of ray seeds.
+ *
+ * The scene's ray range is never materialized up front. Workers carve
+ * chunks off a shared atomic cursor as they need them, and keep those
+ * chunks in a private deque. The owner takes batches from the front of
+ * its deque, and idle workers steal half of the range at the back of
+ * someone else's deque. Each deque has its own lock, which is only
+ * contended during a steal.
+ *
+ * Batch sizes adapt per worker, aiming for a constant amount of time
+ * per batch regardless of how expensive each ray is. Since every ray
+ * is seeded independently, none of this affects the rendered image.
+ */
+
+class ZScheduler {
+public:
+    // A rayLimit of zero means the range is unbounded: it ends only when
+    // the 32-bit seed space runs out, so no seed is ever traced twice.
+    void reset(unsigned workers, uint32_t firstSeed, uint64_t rayLimit);
+
+    // Claim the next batch for a worker. Returns false when no work remains.
+    bool next(unsigned worker, Batch &b);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Target duration for one batch, in seconds
+    static constexpr double kBatchSeconds = 0.002;
+    static const uint32_t kMinBatch = 16;
+    static const uint32_t kMaxBatch = 1 << 16;
+    static const uint32_t kInitialBatch = kMinBatch;
+
+    struct Range {
+        uint64_t begin, end;
+    };
+
+    struct alignas(64) Queue {
+        std::mutex lock;
+        std::deque<Range> ranges;   // Owner pops the front, thieves steal from the back
+        uint32_t batchSize;
+        Clock::time_point lastBatch;
+        bool timing;
+    };
+
+    std::vector<Queue> mQueues;
+    std::atomic<uint64_t> mCursor;
+    uint64_t mLimit;
+    uint32_t mFirstSeed;
+    bool mUnbounded;
+
+    bool takeLocal(Queue &q, Batch &b);
+    bool carve(Queue &q);
+    bool steal(unsigned worker, Queue &q);
+    void adapt(Queue &q);
+};
+
+
+inline void ZScheduler::reset(unsigned workers, uint32_t firstSeed, uint64_t rayLimit)
+{
+    mQueues = std::vector<Queue>(workers);
+    for (unsigned i = 0; i < workers; ++i) {
+        mQueues[i].batchSize = kInitialBatch;
+        mQueues[i].timing = false;
+    }
+
+    mCursor = 0;
+    mUnbounded = !rayLimit;
+    mLimit = rayLimit ? rayLimit : uint64_t(1) << 32;
+    mFirstSeed = firstSeed;
+}
+
+inline bool ZScheduler::next(unsigned worker, Batch &b)
+{
+    Queue &q = mQueues[worker];
+    adapt(q);
+
+    while (!takeLocal(q, b)) {
+        if (!carve(q) && !steal(worker, q))
+            return false;
+    }
+
+    return true;
+}
+
+inline void ZScheduler::adapt(Queue &q)
+{
+    /*
+     * Scale this worker's batch size by how far the previous batch missed
+     * our target duration. Changes are limited to a factor of two per batch
+     * so that one unusually slow ray doesn't throw the estimate far off.
+     */
+
+    Clock::time_point now = Clock::now();
+
+    if (q.timing) {
+        double elapsed = std::chrono::duration<double>(now - q.lastBatch).count();
+        double ratio = elapsed > 0 ? kBatchSeconds / elapsed : 2.0;
+        ratio = std::max(0.5, std::min(2.0, ratio));
+        q.batchSize = std::max<double>(kMinBatch, std::min<double>(kMaxBatch, q.batchSize * ratio));
+    }
+
+    q.lastBatch = now;
+    q.timing = true;
+}
+
+inline bool ZScheduler::takeLocal(Queue &q, Batch &b)
+{
+    std::lock_guard<std::mutex> lock(q.lock);
+
+    if (q.ranges.empty())
+        return false;
+
+    Range &r = q.ranges.front();
+    uint64_t size = std::min<uint64_t>(q.batchSize, r.end - r.begin);
+
+    b.seed = mFirstSeed + uint32_t(r.begin);
+    b.size = size;
+
+    r.begin += size;
+    if (r.begin == r.end)
+        q.ranges.pop_front();
+
+    return true;
+}
+
+inline bool ZScheduler::carve(Queue &q)
+{
+    /*
+     * Carve a new chunk off the shared cursor. Chunks shrink as the remaining
+     * range does (guided self-scheduling) so that workers tend to run out of
+     * work at about the same time, leaving little for stealing to balance.
+     * An unbounded range has no end to aim for, so its chunks stay small.
+     */
+
+    uint64_t begin = mCursor.load(std::memory_order_relaxed);
+    uint64_t end;
+
+    do {
+        if (begin >= mLimit)
+            return false;
+
+        uint64_t remaining = mLimit - begin;
+        uint64_t chunk = uint64_t(q.batchSize) * 4;
+        if (!mUnbounded)
+            chunk = std::max<uint64_t>(chunk, remaining / (4 * mQueues.size()));
+        chunk = std::min<uint64_t>(chunk, remaining);
+        end = begin + chunk;
+
+    } while (!mCursor.compare_exchange_weak(begin, end, std::memory_order_relaxed));
+
+    std::lock_guard<std::mutex> lock(q.lock);
+    Range r = { begin, end };
+    q.ranges.push_back(r);
+    return true;
+}
+
+inline bool ZScheduler::steal(unsigned worker, Queue &q)
+{
+    /*
+     * Look for a victim, starting with our neighbor. We take the back half
+     * of the victim's last range, which is the work it would reach last.
+     */
+
+    unsigned count = mQueues.size();
+
+    for (unsigned i = 1; i < count; ++i) {
+        Queue &victim = mQueues[(worker + i) % count];
+        Range stolen;
+        {
+            std::lock_guard<std::mutex> lock(victim.lock);
+            if (victim.ranges.empty())
+                continue;
+
+            Range &r = victim.ranges.back();
+            uint64_t half = (r.end - r.begin) / 2;
+
+            if (half == 0) {
+                // Only one ray left; take the whole thing.
+                stolen = r;
+                victim.ranges.pop_back();
+            } else {
+                stolen.begin = r.end - half;
+                stolen.end = r.end;
+                r.end = stolen.begin;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(q.lock);
+        q.ranges.push_back(stolen);
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,312 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ztopology.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+
+static std::vector<unsigned> parseCpuList(const char *path)
+{
+    /*
+     * Parse a Linux CPU list file, like "0-3,8-11\n".
+     */
+
+    std::vector<unsigned> result;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return result;
+
+    unsigned first, last;
+    while (fscanf(f, "%u", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &last) != 1)
+                break;
+            c = fgetc(f);
+        }
+        for (unsigned cpu = first; cpu <= last; ++cpu)
+            result.push_back(cpu);
+        if (c != ',')
+            break;
+    }
+
+    fclose(f);
+    return result;
+}
+
+std::vector<unsigned> ZTopology::allowedCpus()
+{
+    std::vector<unsigned> result;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof set, &set) == 0) {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                result.push_back(cpu);
+    }
+#endif
+
+    return result;
+}
+
+static double readQuota(const std::string &dir, bool v2)
+{
+    /*
+     * Read one cgroup directory's CPU limit, in CPUs. Returns zero if this
+     * directory has no limit or doesn't exist.
+     *
+     *   v2: cpu.max holds "<quota> <period>" or "max <period>"
+     *   v1: cpu.cfs_quota_us is -1 when unlimited, next to cpu.cfs_period_us
+     */
+
+    double quota = 0, period = 0;
+
+    if (v2) {
+        FILE *f = fopen((dir + "/cpu.max").c_str(), "r");
+        if (!f)
+            return 0;
+        if (fscanf(f, "%lf %lf", &quota, &period) != 2)
+            quota = 0;
+        fclose(f);
+
+    } else {
+        FILE *f = fopen((dir + "/cpu.cfs_quota_us").c_str(), "r");
+        if (!f)
+            return 0;
+        if (fscanf(f, "%lf", &quota) != 1)
+            quota = 0;
+        fclose(f);
+
+        f = fopen((dir + "/cpu.cfs_period_us").c_str(), "r");
+        if (!f)
+            return 0;
+        if (fscanf(f, "%lf", &period) != 1)
+            period = 0;
+        fclose(f);
+    }
+
+    if (!(quota > 0 && period > 0))
+        return 0;
+    return quota / period;
+}
+
+static double readMemoryLimit(const std::string &dir, bool v2)
+{
+    /*
+     * Read one cgroup directory's memory limit, in bytes. Returns zero if
+     * this directory has no limit or doesn't exist.
+     *
+     *   v2: memory.max holds a byte count, or "max"
+     *   v1: memory.limit_in_bytes holds a byte count, close to 2^63 when unlimited
+     */
+
+    FILE *f = fopen((dir + (v2 ? "/memory.max" : "/memory.limit_in_bytes")).c_str(), "r");
+    if (!f)
+        return 0;
+
+    double limit = 0;
+    if (fscanf(f, "%lf", &limit) != 1)
+        limit = 0;
+    fclose(f);
+
+    if (!(limit > 0 && limit < 1e18))
+        return 0;
+    return limit;
+}
+
+typedef double (*LimitReader)(const std::string &dir, bool v2);
+
+static double limitForPath(LimitReader read, const std::string &mount, std::string path, bool v2)
+{
+    /*
+     * Limits on any ancestor apply too, so take the tightest one between our
+     * own cgroup and the root of the hierarchy. Inside a container the
+     * path may not exist under our mount, and the mount root is our cgroup.
+     */
+
+    double result = 0;
+
+    for (;;) {
+        double q = read(mount + path, v2);
+        if (q > 0 && (result == 0 || q < result))
+            result = q;
+
+        size_t slash = path.rfind('/');
+        if (path.empty() || slash == std::string::npos)
+            break;
+        path.erase(slash);
+    }
+
+    return result;
+}
+
+static double cgroupLimit(LimitReader read, const char *controller)
+{
+    /*
+     * The tightest limit from any cgroup hierarchy we belong to that has
+     * 'controller' enabled, or zero if there's none.
+     */
+
+    double limit = 0;
+
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        return 0;
+
+    // Lines look like "<id>:<controllers>:<path>". v2 has id 0 and no controllers.
+    char line[4096];
+    while (fgets(line, sizeof line, f)) {
+        char *controllers = strchr(line, ':');
+        char *path = controllers ? strchr(controllers + 1, ':') : 0;
+        if (!path)
+            continue;
+        *controllers++ = '\0';
+        *path++ = '\0';
+        path[strcspn(path, "\n")] = '\0';
+
+        std::string p = path;
+        if (p == "/")
+            p.clear();
+
+        double q = 0;
+        if (!strcmp(line, "0") && !*controllers) {
+            q = limitForPath(read, "/sys/fs/cgroup", p, true);
+
+        } else {
+            // Look for our controller in the comma-separated list
+            std::string list = std::string(",") + controllers + ",";
+            if (list.find(std::string(",") + controller + ",") == std::string::npos)
+                continue;
+            q = limitForPath(read, std::string("/sys/fs/cgroup/") + controllers, p, false);
+            if (q == 0)
+                q = limitForPath(read, std::string("/sys/fs/cgroup/") + controller, p, false);
+        }
+
+        if (q > 0 && (limit == 0 || q < limit))
+            limit = q;
+    }
+
+    fclose(f);
+#endif
+
+    return limit;
+}
+
+unsigned ZTopology::cgroupCpuQuota()
+{
+    return unsigned(ceil(cgroupLimit(readQuota, "cpu")));
+}
+
+uint64_t ZTopology::cgroupMemoryLimit()
+{
+    return uint64_t(cgroupLimit(readMemoryLimit, "memory"));
+}
+
+unsigned ZTopology::defaultThreadCount()
+{
+    unsigned count = allowedCpus().size();
+    if (!count)
+        count = std::thread::hardware_concurrency();
+
+    unsigned quota = cgroupCpuQuota();
+    if (quota && (!count || quota < count))
+        count = quota;
+
+    return std::max(1u, count);
+}
+
+ZTopology ZTopology::detect()
+{
+    ZTopology topology;
+    std::vector<unsigned> allowed = allowedCpus();
+
+#ifdef __linux__
+    // Node numbers may be sparse; stop after a generous run of missing ones.
+    for (unsigned id = 0, missing = 0; missing < 64; ++id) {
+        char path[128];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%u/cpulist", id);
+        std::vector<unsigned> cpus = parseCpuList(path);
+
+        if (cpus.empty()) {
+            missing++;
+            continue;
+        }
+        missing = 0;
+
+        Node node;
+        node.id = id;
+        for (unsigned i = 0; i < cpus.size(); ++i)
+            if (std::find(allowed.begin(), allowed.end(), cpus[i]) != allowed.end())
+                node.cpus.push_back(cpus[i]);
+
+        if (!node.cpus.empty())
+            topology.nodes.push_back(node);
+    }
+#endif
+
+    if (topology.nodes.empty()) {
+        // Unknown topology; one node containing everything we're allowed to use.
+        Node node;
+        node.id = 0;
+        node.cpus = allowed;
+        topology.nodes.push_back(node);
+    }
+
+    return topology;
+}
+
+bool ZTopology::pinCurrentThread(const std::vector<unsigned> &cpus)
+{
+#ifdef __linux__
+    if (cpus.empty())
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned i = 0; i < cpus.size(); ++i)
+        if (cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+#else
+    return false;
+#endif
+}
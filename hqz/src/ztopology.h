@@ -0,0 +1,67 @@
+/*
+ * This file is part of HQZ, the batch renderer for Zen Photon Garden.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+
+/**
+ * Utility class for discovering which CPUs we may run on, and how they're
+ * grouped into NUMA nodes. On platforms where we can't tell, everything
+ * looks like one node and thread pinning does nothing.
+ */
+
+class ZTopology {
+public:
+    struct Node {
+        unsigned id;
+        std::vector<unsigned> cpus;     // Only CPUs in our affinity mask
+    };
+
+    std::vector<Node> nodes;
+
+    static ZTopology detect();
+
+    // Restrict the calling thread to a set of CPUs. Returns false on failure.
+    static bool pinCurrentThread(const std::vector<unsigned> &cpus);
+
+    // CPUs in our affinity mask, or empty if unknown.
+    static std::vector<unsigned> allowedCpus();
+
+    // CPU bandwidth allowed by our cgroup (v1 or v2), rounded up to whole
+    // CPUs. Zero if there's no quota or we can't tell.
+    static unsigned cgroupCpuQuota();
+
+    // Memory limit of our cgroup (v1 or v2) in bytes, including any limit
+    // on a parent cgroup. Zero if there's no limit or we can't tell.
+    static uint64_t cgroupMemoryLimit();
+
+    // Sensible default worker count: the affinity mask, limited by the
+    // cgroup quota. Never less than one.
+    static unsigned defaultThreadCount();
+};